@@ -6,13 +6,19 @@
 
 #define FMT_HEADER_ONLY
 
+#include <algorithm>
+#include <climits>
 #include <fmt/format.h>
 #include <fmt/printf.h>
 #include <iostream>
 #include <nlohmann/json.hpp>
 #include <sstream>
+#include <event2/util.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <typeinfo>
+#include <unistd.h>
 
 #include "config.h"
 #include "healthcheck.h"
@@ -26,12 +32,52 @@
 #include "lb_pool.h"
 #include "msg.h"
 #include "pfctl.h"
+#include "stats.h"
 #include "time_helper.h"
+#include "uring.h"
 
 using namespace std;
 
 extern int verbose;
 
+// In the .h file there are only declarations of static variables, here we have
+// definitions.
+map<pair<struct event_base *, int>, const struct timeval *>
+    Healthcheck::common_timeouts;
+vector<struct sockaddr_storage> Healthcheck::source_addresses4;
+vector<struct sockaddr_storage> Healthcheck::source_addresses6;
+std::atomic<unsigned int> Healthcheck::next_source_address{0};
+map<string, Healthcheck *> Healthcheck::probes;
+size_t Healthcheck::shared_checks = 0;
+int Healthcheck::finest_interval = INT_MAX;
+bool Healthcheck::hash_phases = false;
+bool Healthcheck::pacing = false;
+vector<Healthcheck *> Healthcheck::due_checks;
+int Healthcheck::probe_rate = 0;
+int Healthcheck::max_running_checks = 0;
+int Healthcheck::max_probe_sockets = 0;
+std::atomic<int> Healthcheck::reserved_probe_sockets{0};
+int Healthcheck::max_destination_checks = 0;
+map<string, int> Healthcheck::running_destination_checks;
+double Healthcheck::probe_tokens = 0;
+struct timespec Healthcheck::tokens_updated;
+struct timespec Healthcheck::last_scheduled;
+float Healthcheck::loop_lag = 0;
+int Healthcheck::overload_level = 0;
+
+CheckPriority check_priority_from_string(string s) {
+  if (s == "low")
+    return CheckPriority::LOW;
+  if (s == "normal")
+    return CheckPriority::NORMAL;
+  if (s == "high")
+    return CheckPriority::HIGH;
+
+  log(MessageType::MSG_CRIT,
+      "Unknown priority " + s + ", falling back to normal!");
+  return CheckPriority::NORMAL;
+}
+
 /// Constructor of Healthcheck class.
 ///
 /// Link the healthcheck and its parent node, initialize some variables,
@@ -50,11 +96,11 @@ Healthcheck::Healthcheck(const nlohmann::json &config,
   parent_lbnode->healthchecks.push_back(this);
   this->ip_address = ip_address;
 
-  // Determine type of IP address given to this health check.
-  // Checks based on functions of libevent take IP address in string form
-  // and perform their own magic. Custom checks like tcp or ping operate
-  // on old style structures and have different code for each address
-  // family so we can as well help them.
+  // Determine type of IP address given to this health check and parse it
+  // once for all types of checks. Checks based on functions of libevent
+  // take IP address in string form and perform their own magic. Custom
+  // checks like tcp, dns or ping operate on old style structures. All of
+  // them can connect to the parsed address, they only have to set the port.
   struct addrinfo hint, *res = NULL;
   int ret;
   memset(&hint, 0, sizeof hint);
@@ -62,7 +108,6 @@ Healthcheck::Healthcheck(const nlohmann::json &config,
   hint.ai_flags = AI_NUMERICHOST;
   ret = getaddrinfo(this->ip_address->c_str(), NULL, &hint, &res);
   if (ret) {
-    freeaddrinfo(res);
     throw(NotLbPoolException(fmt::sprintf("Unable to parse IP address '%s'",
                                           this->ip_address->c_str())));
   } else {
@@ -71,11 +116,35 @@ Healthcheck::Healthcheck(const nlohmann::json &config,
       this->af_string = "IPv4";
     if (this->address_family == AF_INET6)
       this->af_string = "IPv6";
+    memset(&this->address, 0, sizeof(this->address));
+    memcpy(&this->address, res->ai_addr, res->ai_addrlen);
+    this->address_len = res->ai_addrlen;
     freeaddrinfo(res);
   }
 
   // Set defaults, same as with old testtool.
-  this->check_interval = safe_get<int>(config, "hc_interval", 2);
+  this->check_interval = safe_get<int>(config, "hc_interval_ms",
+                                       safe_get<int>(config, "hc_interval", 2) *
+                                           1000);
+  if (this->check_interval <= 0) {
+    log(MessageType::MSG_CRIT, parent_lbnode,
+        fmt::sprintf("Invalid hc_interval of %dms, falling back to 2s!",
+                     this->check_interval));
+    this->check_interval = 2000;
+  }
+  this->max_interval = safe_get<int>(config, "hc_interval_max", 0) * 1000;
+  this->current_interval = this->check_interval;
+  this->retry_interval = safe_get<int>(config, "hc_retry_interval", 0);
+  if (this->retry_interval < 0) {
+    log(MessageType::MSG_CRIT, parent_lbnode,
+        fmt::sprintf("Invalid hc_retry_interval of %dms, using hc_interval!",
+                     this->retry_interval));
+    this->retry_interval = 0;
+  }
+  this->latency_average = -1;
+  finest_interval = min(finest_interval, this->check_interval);
+  if (this->retry_interval)
+    finest_interval = min(finest_interval, this->retry_interval);
   this->max_failed_checks = safe_get<int>(config, "hc_max_failed", 3);
   int tmp_timeout = safe_get<int>(config, "hc_timeout", 1500);
   // Timeout was read in ms, convert it to s and μs.
@@ -83,9 +152,17 @@ Healthcheck::Healthcheck(const nlohmann::json &config,
   this->timeout.tv_usec = (tmp_timeout % 1000) * 1000;
   // Random delay to spread healthchecks in space-time continuum.
   this->extra_delay = rand() % 1000;
+  this->phase = -1;
+  this->priority = parent_lbnode->parent_lbpool->priority;
+  memcpy(&next_due, &last_checked, sizeof(struct timespec));
+  timespec_add_ms(&next_due, check_interval + extra_delay);
+  this->rst_close = safe_get<bool>(config, "hc_rst_close", false);
 
   this->is_running = false;
   this->ran = false;
+  this->leader = NULL;
+  this->admitted = false;
+  this->socket_reserved = false;
 
   // Initialize healthchecks state basing on state of parent node.
   // Proper initial state for the healthcheck guarantees no
@@ -101,10 +178,21 @@ Healthcheck::Healthcheck(const nlohmann::json &config,
   }
 }
 
+/// FNV-1a hash of a string, 32 bit variant.
+static uint32_t fnv1a(const string &s) {
+  uint32_t hash = 2166136261u;
+  for (unsigned char c : s) {
+    hash ^= c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
 /// Healthcheck factory
 ///
 /// - reads type of healthcheck
 /// - creates an object of the required type, pass the config to it
+/// - subscribes it to an existing check with the same probe, if there is one
 /// - returns it
 Healthcheck *Healthcheck::healthcheck_factory(const nlohmann::json &config,
                                               class LbNode *_parent_lbnode,
@@ -132,7 +220,31 @@ Healthcheck *Healthcheck::healthcheck_factory(const nlohmann::json &config,
   else
     return NULL;
 
-  log(MessageType::MSG_INFO, new_healthcheck, "state: created");
+  string probe_key = new_healthcheck->get_probe_key();
+  if (hash_phases && new_healthcheck->check_interval > 0) {
+    string name = _parent_lbnode->parent_lbpool->name + " " +
+                  _parent_lbnode->name + " " + probe_key;
+    new_healthcheck->phase = fnv1a(name) % new_healthcheck->check_interval;
+    new_healthcheck->set_next_due_in_phase(&new_healthcheck->last_checked);
+  }
+
+  auto probe = probes.find(probe_key);
+  if (probe == probes.end()) {
+    probes[probe_key] = new_healthcheck;
+    new_healthcheck->init_probe();
+    log(MessageType::MSG_INFO, new_healthcheck, "state: created");
+  } else {
+    new_healthcheck->leader = probe->second;
+    probe->second->followers.push_back(new_healthcheck);
+    // The probe runs for the most important of its checks.
+    if (new_healthcheck->priority > probe->second->priority)
+      probe->second->priority = new_healthcheck->priority;
+    shared_checks++;
+    log(MessageType::MSG_INFO, new_healthcheck,
+        fmt::sprintf("state: created probe: shared with lbpool: %s lbnode: %s",
+                     probe->second->parent_lbnode->parent_lbpool->name,
+                     probe->second->parent_lbnode->name));
+  }
 
   return new_healthcheck;
 }
@@ -149,13 +261,42 @@ int Healthcheck::schedule_healthcheck(struct timespec *now) {
   if (is_running)
     return false;
 
+  // Results of shared probes are delivered by the leader.
+  if (leader)
+    return false;
+
   // Check if host should be checked at this time.
-  if (timespec_diff_ms(now, &last_checked) <
-      check_interval * 1000 + extra_delay)
+  if (timespec_diff_ms(now, &next_due) < 0)
     return false;
 
+  // Wait for admission, it will call this method again.
+  if (pacing && !admitted) {
+    due_checks.push_back(this);
+    return false;
+  }
+  admitted = false;
+
+  // The next run is due one interval after this one was due, so that the
+  // checks don't drift by the delay of the scheduler. If the scheduler is
+  // late by a whole interval, the missed runs are skipped.
+  int interval = current_interval * get_overload_stretch();
+  timespec_add_ms(&next_due, interval);
+  if (timespec_diff_ms(now, &next_due) >= 0) {
+    memcpy(&next_due, now, sizeof(struct timespec));
+    timespec_add_ms(&next_due, interval);
+  }
+
   memcpy(&last_checked, now, sizeof(struct timespec));
   is_running = true;
+  stats.checks_running++;
+  running_destination_checks[*ip_address]++;
+
+  // The socket counts against the limit from now on, even if it is opened
+  // only later.
+  if (opens_probe_socket()) {
+    socket_reserved = true;
+    reserved_probe_sockets++;
+  }
 
   if (verbose > 1)
     log(MessageType::MSG_INFO, this, "scheduling");
@@ -163,6 +304,10 @@ int Healthcheck::schedule_healthcheck(struct timespec *now) {
   return true;
 }
 
+Healthcheck::~Healthcheck() {
+  // Nothing to do here, it is used only for some types of healthchecks.
+}
+
 /// Finalize a healthcheck
 ///
 /// This metod allows the check to have some final thoughts on its result.
@@ -210,6 +355,349 @@ void Healthcheck::end_check(HealthcheckResult result, string message) {
   }
 
   this->parent_lbnode->node_logic();
+
+  // Each subscriber of a shared probe applies the result to its own node.
+  for (auto follower : followers)
+    follower->end_check(result, message);
+
+  if (!leader)
+    this->update_interval(result);
+}
+
+/// Build the key under which probes of checks are shared.
+///
+/// It consists only of parameters which define the probe and its result:
+/// the type, the address, the timeout and how the connection is closed.
+/// Check types add their own parameters, including anything specific to the
+/// LB Pool or LB Node they send. Intervals and hc_max_failed are left out,
+/// they apply to handling of results by each check.
+string Healthcheck::get_probe_key() {
+  return fmt::sprintf("%s %s timeout: %d rst_close: %d", type, *ip_address,
+                      timeout_to_ms(), rst_close);
+}
+
+/// Set up what is needed to run the probe.
+///
+/// Called by the factory only for checks running their own probe, followers
+/// never run it.
+void Healthcheck::init_probe() {
+  // Nothing to do here, it is used only for some types of healthchecks.
+}
+
+/// Tell if each run of the check opens its own socket.
+///
+/// Such checks are limited by the number of open probe sockets. Checks
+/// sharing sockets of their type, like ping and dns, are not.
+bool Healthcheck::opens_probe_socket() { return false; }
+
+/// Interval of the healthcheck scheduler (ms).
+///
+/// Checks are scheduled 10 times per second. If any check is to run more
+/// often than once per second, the scheduler runs often enough to keep
+/// their intervals accurate too.
+int Healthcheck::get_scheduler_tick() {
+  if (finest_interval < 1000)
+    return SCHEDULER_TICK_FINE;
+  return SCHEDULER_TICK;
+}
+
+/// Limit the rate of new probes, the number of running checks, of running
+/// checks per destination address and of probe sockets.
+///
+/// Once called, checks are not started directly by the scheduler but by
+/// admit_due_checks() which it must call after scheduling all checks.
+/// Without the socket limit, probes stop before reaching RLIMIT_NOFILE.
+/// Testtool calls it only if any limit is given.
+void Healthcheck::set_probe_budget(int rate, int max_running,
+                                   int max_sockets, int max_destination) {
+  pacing = true;
+  probe_rate = rate;
+  max_running_checks = max_running;
+  max_probe_sockets = max_sockets;
+  max_destination_checks = max_destination;
+
+  struct rlimit rlim;
+  if (!max_probe_sockets && getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+      rlim.rlim_cur != RLIM_INFINITY) {
+    if (rlim.rlim_cur > 2 * PROBE_FD_RESERVE)
+      max_probe_sockets = rlim.rlim_cur - PROBE_FD_RESERVE;
+    else
+      max_probe_sockets = rlim.rlim_cur / 2;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &tokens_updated);
+}
+
+/// Start checks which are due, as long as the probe budget allows.
+///
+/// Checks of higher priority go first, then those which have been due for
+/// the longest time. The others
+/// stay due and are considered again by the next run of the scheduler.
+/// Checks of a destination with too many running checks are skipped, so
+/// that they are started first once that destination is not busy anymore.
+void Healthcheck::admit_due_checks(struct timespec *now) {
+  if (!pacing)
+    return;
+
+  // Tokens are not saved for longer than one run of the scheduler, so that
+  // probes are not started in bursts after a quiet time.
+  if (probe_rate) {
+    probe_tokens +=
+        probe_rate * timespec_diff_ms(now, &tokens_updated) / 1000.0;
+    probe_tokens =
+        min(probe_tokens, max(probe_rate * SCHEDULER_TICK / 1000.0, 1.0));
+    memcpy(&tokens_updated, now, sizeof(struct timespec));
+  }
+
+  sort(due_checks.begin(), due_checks.end(),
+       [](Healthcheck *a, Healthcheck *b) {
+         if (a->priority != b->priority)
+           return a->priority > b->priority;
+         return timespec_diff_ms(&a->next_due, &b->next_due) < 0;
+       });
+
+  size_t checked = 0;
+  long deferred = 0;
+  Healthcheck *oldest_deferred = NULL;
+  for (auto hc : due_checks) {
+    if (probe_rate && probe_tokens < 1)
+      break;
+    if (max_running_checks && stats.checks_running >= max_running_checks)
+      break;
+    if (max_probe_sockets &&
+        stats.probe_sockets + reserved_probe_sockets >= max_probe_sockets)
+      break;
+    checked++;
+
+    // A busy destination doesn't stop checks of other ones.
+    if (max_destination_checks &&
+        running_destination_checks[*hc->ip_address] >=
+            max_destination_checks) {
+      stats.destination_deferrals++;
+      deferred++;
+      if (!oldest_deferred)
+        oldest_deferred = hc;
+      continue;
+    }
+
+    hc->admitted = true;
+    if (hc->schedule_healthcheck(now) && probe_rate)
+      probe_tokens--;
+    hc->admitted = false;
+  }
+
+  deferred += due_checks.size() - checked;
+  if (!oldest_deferred && checked < due_checks.size())
+    oldest_deferred = due_checks[checked];
+  stats.checks_deferred = deferred;
+  stats.deferrals += deferred;
+  if (oldest_deferred)
+    stats.deferral_ms = timespec_diff_ms(now, &oldest_deferred->next_due);
+  else
+    stats.deferral_ms = 0;
+
+  due_checks.clear();
+}
+
+/// Remove the probe budget and forget checks counted against it.
+///
+/// Used by tests, which start with no budget, like testtool without options.
+void Healthcheck::forget_probe_budget() {
+  pacing = false;
+  probe_rate = 0;
+  max_running_checks = 0;
+  max_probe_sockets = 0;
+  max_destination_checks = 0;
+  probe_tokens = 0;
+  reserved_probe_sockets = 0;
+  due_checks.clear();
+  running_destination_checks.clear();
+}
+
+/// Number of checks which do not run their own probe.
+size_t Healthcheck::count_shared_checks() { return shared_checks; }
+
+/// Stop sharing probes with checks created until now.
+///
+/// Checks created afterwards will get their own probes, which is necessary
+/// when the checks created before are abandoned, as they are when the
+/// configuration is loaded again.
+void Healthcheck::forget_probes() {
+  probes.clear();
+  shared_checks = 0;
+}
+
+/// Choose interval until the next probe basing on the result of this one.
+///
+/// While a failure is being confirmed, hc_retry_interval is used if set.
+/// Checks with hc_interval_max longer than
+/// hc_interval double their interval with each passed probe, as long as they
+/// are hard up. A failure or a probe which took much longer than usual
+/// returns to hc_interval at once.
+void Healthcheck::update_interval(HealthcheckResult result) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int latency = timespec_diff_ms(&now, &last_checked);
+  int new_interval = check_interval;
+  bool retrying = false;
+
+  if (retry_interval && result != HealthcheckResult::HC_PASS) {
+    retrying = this->is_confirming_failure();
+    for (auto follower : followers)
+      retrying |= follower->is_confirming_failure();
+  }
+
+  if (retrying) {
+    new_interval = retry_interval;
+  } else if (max_interval > check_interval &&
+             result == HealthcheckResult::HC_PASS &&
+             hard_state == HealthcheckState::STATE_UP &&
+             (latency_average < 0 ||
+              latency <= 2 * latency_average + ADAPTIVE_LATENCY_SLACK)) {
+    new_interval =
+        min(max(current_interval * 2, check_interval), max_interval);
+  }
+
+  if (result == HealthcheckResult::HC_PASS) {
+    if (latency_average < 0)
+      latency_average = latency;
+    else
+      latency_average = (7 * latency_average + latency) / 8;
+  }
+
+  // The new interval counts from the start of this run.
+  if (new_interval != current_interval) {
+    if (verbose > 1)
+      log(MessageType::MSG_INFO, this,
+          fmt::sprintf("interval: %dms latency: %dms", new_interval, latency));
+    if (phase >= 0 && new_interval == check_interval) {
+      set_next_due_in_phase(&last_checked);
+    } else {
+      memcpy(&next_due, &last_checked, sizeof(struct timespec));
+      timespec_add_ms(&next_due, new_interval);
+    }
+  }
+  current_interval = new_interval;
+}
+
+/// Make the check due at the first moment after the given one which is in
+/// its phase.
+///
+/// Phases are counted on the real time clock, so that checks run at the same
+/// moments of their intervals after a restart too.
+void Healthcheck::set_next_due_in_phase(struct timespec *after) {
+  if (phase < 0 || check_interval <= 0)
+    return;
+
+  struct timespec real_now, now;
+  clock_gettime(CLOCK_REALTIME, &real_now);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  long long after_ms = real_now.tv_sec * 1000LL + real_now.tv_nsec / 1000000 +
+                       timespec_diff_ms(after, &now);
+  int delay = (phase - after_ms % check_interval + check_interval) %
+              check_interval;
+  if (delay == 0)
+    delay = check_interval;
+
+  memcpy(&next_due, after, sizeof(struct timespec));
+  timespec_add_ms(&next_due, delay);
+}
+
+/// Spread checks over their intervals by hash of LB Pool, LB Node and check
+/// instead of randomly. Must be called before checks are created.
+void Healthcheck::set_hash_phases(bool enabled) { hash_phases = enabled; }
+
+/// Spread the first runs of checks evenly over the warm-up period.
+///
+/// Only checks running their own probes are affected, the others are never
+/// scheduled anyway. Checks with hash phases keep them, they start in one of
+/// the whole intervals which fit into the period, chosen by their phase.
+/// Those with intervals longer than the period start within one interval.
+void Healthcheck::start_warm_up(int period) {
+  if (period <= 0)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  for (auto &probe : probes) {
+    Healthcheck *hc = probe.second;
+    struct timespec start;
+    memcpy(&start, &now, sizeof(struct timespec));
+    if (hc->phase >= 0) {
+      hc->set_next_due_in_phase(&start);
+      int intervals = period / hc->check_interval;
+      if (intervals > 1)
+        timespec_add_ms(&hc->next_due,
+                        hc->phase * intervals / hc->check_interval *
+                            hc->check_interval);
+    } else {
+      timespec_add_ms(&start, rand() % period);
+      memcpy(&hc->next_due, &start, sizeof(struct timespec));
+    }
+  }
+}
+
+/// Measure lag of the main loop and derive the overload level from it.
+///
+/// Must be called by each run of the scheduler. The lag is how much later
+/// than expected the scheduler runs, smoothed over recent runs.
+void Healthcheck::measure_loop_lag(struct timespec *now) {
+  if (last_scheduled.tv_sec || last_scheduled.tv_nsec) {
+    int lag = timespec_diff_ms(now, &last_scheduled) - get_scheduler_tick();
+    loop_lag = (7 * loop_lag + max(lag, 0)) / 8;
+  }
+  memcpy(&last_scheduled, now, sizeof(struct timespec));
+
+  // A level is left only once the lag falls to half of what raised it, so
+  // that it doesn't flap.
+  int level = overload_level;
+  while (level < OVERLOAD_LEVELS && loop_lag >= OverloadLags[level])
+    level++;
+  while (level > 0 && loop_lag < OverloadLags[level - 1] / 2)
+    level--;
+
+  if (level != overload_level)
+    log(MessageType::MSG_INFO,
+        fmt::sprintf("testtool: overload level: %d loop lag: %dms", level,
+                     (int)loop_lag));
+  overload_level = level;
+  stats.overload_level = level;
+  stats.loop_lag_ms = loop_lag;
+}
+
+/// Start measuring lag of the main loop from scratch, at overload level 0.
+///
+/// Used by tests, like forget_probe_budget().
+void Healthcheck::forget_loop_lag() {
+  memset(&last_scheduled, 0, sizeof(struct timespec));
+  loop_lag = 0;
+  overload_level = 0;
+}
+
+/// How many times longer the interval of the check is at the current
+/// overload level.
+///
+/// Each overload level doubles intervals of low priority checks. Starting
+/// with the second level, intervals of normal priority checks are doubled
+/// too. High priority checks always keep their intervals.
+int Healthcheck::get_overload_stretch() {
+  switch (priority) {
+  case CheckPriority::LOW:
+    return 1 << overload_level;
+  case CheckPriority::NORMAL:
+    return overload_level > 1 ? 1 << (overload_level - 1) : 1;
+  case CheckPriority::HIGH:
+    break;
+  }
+  return 1;
+}
+
+/// A check is confirming a failure after it has failed at least once but not
+/// enough times to go hard down.
+bool Healthcheck::is_confirming_failure() {
+  return hard_state == HealthcheckState::STATE_UP && failure_counter > 0;
 }
 
 /// Handle healthcheck's result once it's finished.
@@ -265,8 +753,167 @@ void Healthcheck::handle_result(string message) {
   }
 
   // Mark the check as not running, so it can be scheduled again.
+  if (socket_reserved) {
+    socket_reserved = false;
+    reserved_probe_sockets--;
+  }
+  if (is_running) {
+    stats.checks_running--;
+    if (--running_destination_checks[*ip_address] == 0)
+      running_destination_checks.erase(*ip_address);
+  }
   is_running = false;
   ran = true;
 }
 
+/// Set port number of the parsed address of this check.
+void Healthcheck::set_address_port(int port) {
+  if (address_family == AF_INET)
+    ((struct sockaddr_in *)&address)->sin_port = htons(port);
+  else if (address_family == AF_INET6)
+    ((struct sockaddr_in6 *)&address)->sin6_port = htons(port);
+}
+
+/// Get the timeout of this check for use with given event base.
+///
+/// Most checks share a few timeout values.  Instead of putting each timeout
+/// into libevent's min-heap, they are added to a common timeout queue of the
+/// event base, one for each value.  Adding and removing them is then O(1).
+/// Must be called from the main loop, as the cache is not locked.
+const struct timeval *Healthcheck::get_common_timeout(struct event_base *base) {
+  auto key = make_pair(base, this->timeout_to_ms());
+  auto it = common_timeouts.find(key);
+  if (it != common_timeouts.end())
+    return it->second;
+
+  const struct timeval *common_timeout =
+      event_base_init_common_timeout(base, &this->timeout);
+
+  // libevent has a limit on the number of common timeouts per event base.
+  // Fall back to the regular timeout then.
+  if (common_timeout == NULL)
+    return &this->timeout;
+
+  common_timeouts[key] = common_timeout;
+  return common_timeout;
+}
+
+/// Add an address for probe connections to be bound to
+///
+/// Returns false if the address can't be parsed.
+bool Healthcheck::add_source_address(const string &source_address) {
+  struct addrinfo hint, *res = NULL;
+  memset(&hint, 0, sizeof hint);
+  hint.ai_family = PF_UNSPEC;
+  hint.ai_flags = AI_NUMERICHOST;
+  if (getaddrinfo(source_address.c_str(), NULL, &hint, &res))
+    return false;
+
+  struct sockaddr_storage address;
+  memset(&address, 0, sizeof(address));
+  memcpy(&address, res->ai_addr, res->ai_addrlen);
+  if (res->ai_family == AF_INET)
+    source_addresses4.push_back(address);
+  else
+    source_addresses6.push_back(address);
+  freeaddrinfo(res);
+
+  return true;
+}
+
+size_t Healthcheck::count_source_addresses() {
+  return source_addresses4.size() + source_addresses6.size();
+}
+
+/// Open a nonblocking socket for a probe connection
+///
+/// If there are source addresses for our address family, the socket is
+/// bound to the next one. The port is chosen only by connect(), so that
+/// it has to be unique for the whole 4-tuple and not for the source
+/// address alone. Returns -1 on failure, errno is then left as set by
+/// the failed function.
+evutil_socket_t Healthcheck::open_probe_socket() {
+  evutil_socket_t fd = socket(address_family, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  evutil_make_socket_nonblocking(fd);
+
+  vector<struct sockaddr_storage> &source_addresses =
+      (address_family == AF_INET) ? source_addresses4 : source_addresses6;
+  if (!source_addresses.empty()) {
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    int on = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+#endif
+    struct sockaddr_storage *source_address =
+        &source_addresses[next_source_address++ % source_addresses.size()];
+    if (bind(fd, (struct sockaddr *)source_address, address_len) == -1) {
+      int error = errno;
+      close(fd);
+      errno = error;
+      return -1;
+    }
+  }
+
+  add_probe_socket();
+  return fd;
+}
+
+/// Count a probe socket which has just been opened
+///
+/// It takes the place of the socket reserved when the check was started.
+void Healthcheck::add_probe_socket() {
+  if (socket_reserved) {
+    socket_reserved = false;
+    reserved_probe_sockets--;
+  }
+  stats.probe_sockets++;
+}
+
+/// Stop counting a probe socket which is about to be closed
+void Healthcheck::remove_probe_socket() { stats.probe_sockets--; }
+
+/// Prepare the socket of a finished probe connection to be closed
+///
+/// Closing with RST leaves no TIME_WAIT socket behind. It can be done
+/// safely only once the result is known.
+void Healthcheck::release_probe_socket(evutil_socket_t fd) {
+  if (rst_close) {
+    struct linger linger = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    stats.probe_resets++;
+  }
+  remove_probe_socket();
+}
+
+/// Free the bufferevent of a probe connection and close its socket
+void Healthcheck::free_probe_bufferevent(struct bufferevent *bev) {
+  evutil_socket_t fd = bufferevent_getfd(bev);
+  if (fd != -1)
+    release_probe_socket(fd);
+  bufferevent_free(bev);
+}
+
+/// Close the socket of a probe connection driven by io_uring
+void Healthcheck::close_probe_socket(evutil_socket_t fd) {
+  release_probe_socket(fd);
+  Uring::close(fd);
+}
+
 int Healthcheck::timeout_to_ms() { return timeval_to_ms(&this->timeout); }
+
+/// Get the time left until the running check times out
+///
+/// Returns false if there is none left.
+bool Healthcheck::get_time_left(struct timeval *left) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  int left_ms = timeout_to_ms() - timespec_diff_ms(&now, &last_checked);
+  if (left_ms <= 0)
+    return false;
+
+  left->tv_sec = left_ms / 1000;
+  left->tv_usec = (left_ms % 1000) * 1000;
+  return true;
+}
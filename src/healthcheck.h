@@ -6,16 +6,45 @@
 #ifndef _HEALTHCHECK_H_
 #define _HEALTHCHECK_H_
 
+#include <atomic>
+#include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <iostream>
+#include <map>
 #include <netinet/in.h>
 #include <nlohmann/json.hpp>
 #include <sstream>
+#include <vector>
 
 #include "lb_node.h"
 
 using namespace std;
 
+// Probes of adaptive checks taking this much longer than twice the usual
+// duration are treated as anomalies (ms).
+#define ADAPTIVE_LATENCY_SLACK 5
+
+// Intervals of the healthcheck scheduler, the fine one is used if any check
+// runs more often than once per second (ms).
+#define SCHEDULER_TICK 100
+#define SCHEDULER_TICK_FINE 10
+
+// File descriptors left for everything but probe sockets, if their number
+// is limited only by RLIMIT_NOFILE.
+#define PROBE_FD_RESERVE 256
+
+// Lag of the main loop, smoothed, from which the overload level is raised by
+// one (ms).
+#define OVERLOAD_LEVELS 3
+static const int OverloadLags[OVERLOAD_LEVELS] = {25, 100, 400};
+
+// Priority of checks, taken from their LB Pool. Under overload checks of
+// lower priority run less often.
+enum class CheckPriority { LOW, NORMAL, HIGH };
+static const char *CheckPriorityNames[] = {"low", "normal", "high"};
+
+CheckPriority check_priority_from_string(string s);
+
 struct HealthcheckSchedulingException : public std::exception {
   string msg;
   HealthcheckSchedulingException(const std::string &_msg) : msg(_msg) {}
@@ -71,13 +100,43 @@ public:
   virtual int schedule_healthcheck(struct timespec *now);
   Healthcheck(const nlohmann::json &config, class LbNode *_parent_lbnode,
               string *ip_address);
+  virtual ~Healthcheck();
   virtual void finalize();
   int timeout_to_ms();
+  static bool add_source_address(const string &source_address);
+  static size_t count_source_addresses();
+  static size_t count_shared_checks();
+  static void forget_probes();
+  static int get_scheduler_tick();
+  static void set_hash_phases(bool enabled);
+  static void start_warm_up(int period);
+  static void measure_loop_lag(struct timespec *now);
+  static void forget_loop_lag();
+  static void set_probe_budget(int rate, int max_running, int max_sockets,
+                               int max_destination);
+  static void admit_due_checks(struct timespec *now);
+  static void forget_probe_budget();
 
 protected:
   void end_check(HealthcheckResult result, string message);
+  void set_address_port(int port);
+  const struct timeval *get_common_timeout(struct event_base *base);
+  bool get_time_left(struct timeval *left);
+  evutil_socket_t open_probe_socket();
+  void free_probe_bufferevent(struct bufferevent *bev);
+  void release_probe_socket(evutil_socket_t fd);
+  void close_probe_socket(evutil_socket_t fd);
+  void add_probe_socket();
+  void remove_probe_socket();
+  virtual string get_probe_key();
+  virtual void init_probe();
+  virtual bool opens_probe_socket();
 
 private:
+  void update_interval(HealthcheckResult result);
+  bool is_confirming_failure();
+  void set_next_due_in_phase(struct timespec *after);
+  int get_overload_stretch();
   void handle_result(string message);
 
   // Members
@@ -91,18 +150,79 @@ public:
 
 protected:
   struct timespec last_checked; // The last time this host was checked.
+  struct timespec next_due;     // The next check should start at this time.
   struct timeval timeout;
   bool is_running;
   string *ip_address; // IP address for this check of given address family.
   int address_family;
+  // The same address, parsed once for use by socket functions. Port number
+  // is filled in by type-specific constructor.
+  struct sockaddr_storage address;
+  socklen_t address_len;
+  bool rst_close; // Close probe connections with RST.
 
 private:
-  int check_interval;         // Perform a check every n seconds (s).
+  int check_interval;         // Perform a check every n ms.
+  int max_interval;           // Adaptive checks back off up to this (ms).
+  int current_interval;       // Interval until the next check (ms).
+  int retry_interval;         // Interval while confirming a failure (ms).
+  float latency_average;      // Smoothed duration of passed probes (ms).
   unsigned short extra_delay; // Additional delay to spread checks (ms).
+  int phase; // Offset of runs within the interval, -1 if random (ms).
+  CheckPriority priority;
   int max_failed_checks; // Take action only after this number of contiguous
                          // checks fail.
   unsigned short failure_counter; // This many checks have failed until now.
   string af_string;               // Address family for printing log messages
+
+  // Checks with identical probe parameters against the same address share
+  // one probe. Only the leader runs it, followers get its results but keep
+  // their own failure counting.
+  Healthcheck *leader;
+  vector<Healthcheck *> followers;
+  static map<string, Healthcheck *> probes;
+  static size_t shared_checks;
+
+  // The shortest interval of all checks (ms).
+  static int finest_interval;
+  static bool hash_phases;
+
+  // With a probe budget, due checks are started by admit_due_checks() in
+  // order of their due time, as long as there are tokens for new probes
+  // and the number of running checks and probe sockets is below limits.
+  // Running checks are counted per destination address too, whether there
+  // is a probe budget or not.
+  bool admitted;
+  bool socket_reserved;
+  static bool pacing;
+  static vector<Healthcheck *> due_checks;
+  static int probe_rate;         // Probes per second, 0 for no limit.
+  static int max_running_checks; // 0 for no limit.
+  static int max_probe_sockets;  // 0 for no limit.
+  // Started checks which have not opened their probe socket yet. Sockets
+  // of HTTPS checks are opened by TLS workers, so the counter is atomic.
+  static std::atomic<int> reserved_probe_sockets;
+  static int max_destination_checks; // Per address, 0 for no limit.
+  static map<string, int> running_destination_checks;
+  static double probe_tokens;
+  static struct timespec tokens_updated;
+
+  // Lateness of the scheduler is the lag of the main loop.
+  static struct timespec last_scheduled;
+  static float loop_lag; // Smoothed (ms).
+  static int overload_level;
+
+  // Timeouts of all checks are registered in libevent's common timeout
+  // queues, one queue per distinct timeout value and event base.
+  static map<pair<struct event_base *, int>, const struct timeval *>
+      common_timeouts;
+
+  // Probe connections are bound to those addresses in turns, so that there
+  // are more ephemeral ports for them. Probes are started by TLS workers
+  // too, so the counter is atomic.
+  static vector<struct sockaddr_storage> source_addresses4;
+  static vector<struct sockaddr_storage> source_addresses6;
+  static std::atomic<unsigned int> next_source_address;
 };
 
 #endif
@@ -6,8 +6,8 @@
 // * It does not support truncated messages.  Only the first answering
 //   datagram is parsed.
 // * It does not really check for what is in the answer.  It only
-//   checks if the number of answer sections is bigger than 0 and
-//   the transaction number.
+//   checks if the number of answer sections is bigger than 0.  The answer
+//   is mapped to the check by its source address and transaction number.
 //
 // Copyright (c) 2018 InnoGames GmbH
 //
@@ -31,6 +31,9 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <vector>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 
 #include "config.h"
 #include "healthcheck.h"
@@ -46,7 +49,12 @@ extern int verbose;
 
 // In the .h file there are only declarations of static variables,
 // here we have definitions.
-uint16_t Healthcheck_dns::global_transaction_id;
+int Healthcheck_dns::socket4_fd = -1;
+int Healthcheck_dns::socket6_fd = -1;
+struct event *Healthcheck_dns::ev4;
+struct event *Healthcheck_dns::ev6;
+unordered_map<string, Healthcheck_dns *> Healthcheck_dns::queries;
+std::mt19937 Healthcheck_dns::random_generator;
 
 static unsigned int build_dns_question(string &dns_query,
                                        char *question_buffer);
@@ -65,31 +73,16 @@ Healthcheck_dns::Healthcheck_dns(const nlohmann::json &config,
   this->dns_query = safe_get<string>(config, "hc_query", ".");
   if (this->dns_query.at(this->dns_query.length() - 1) != '.')
     this->dns_query += '.';
+  this->set_address_port(port);
 
   this->log_prefix =
       fmt::sprintf("query: '%s' port: %d", this->dns_query, this->port);
-}
-
-int Healthcheck_dns::schedule_healthcheck(struct timespec *now) {
-  char raw_packet[DNS_BUFFER_SIZE]; // This should be enough for our purposes.
-  unsigned int question_length;
-  unsigned int total_length;
-  struct sockaddr_in to_addr4;
-  struct sockaddr_in6 to_addr6;
 
-  // Peform general stuff for scheduled healthcheck
-  if (Healthcheck::schedule_healthcheck(now) == false)
-    return false;
-
-  // Prepare memory
-  memset(&raw_packet, 0, sizeof(raw_packet));
-
-  struct dns_header *dns_query_struct = (struct dns_header *)raw_packet;
-  char *dns_question = raw_packet + sizeof(struct dns_header);
+  // The query is the same for each run, apart from the transaction id.
+  memset(&query_packet, 0, sizeof(query_packet));
 
-  // Fill in the query struct
-  dns_query_struct->qid =
-      htons(my_transaction_id = ++Healthcheck_dns::global_transaction_id);
+  struct dns_header *dns_query_struct = (struct dns_header *)query_packet;
+  char *dns_question = query_packet + sizeof(struct dns_header);
 
   dns_query_struct->rd = 1; // 1 bit.  Do the recursvie query if needed.
   dns_query_struct->tc = 0; // 1 bit.  Message is not truncated.
@@ -103,52 +96,148 @@ int Healthcheck_dns::schedule_healthcheck(struct timespec *now) {
 
   dns_query_struct->qdcount = htons(1); // There is 1 question to be sent.
 
-  question_length = build_dns_question(dns_query, dns_question);
-  total_length = sizeof(struct dns_header) + question_length;
-
-  int pton_res;
-  if (address_family == AF_INET) {
-    memset(&to_addr4, 0, sizeof(to_addr4));
-    to_addr4.sin_family = AF_INET;
-    pton_res = inet_pton(AF_INET, ip_address->c_str(), &to_addr4.sin_addr);
-    to_addr4.sin_port = htons(port);
-    socket_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  } else if (address_family == AF_INET6) {
-    memset(&to_addr6, 0, sizeof(to_addr6));
-    to_addr6.sin6_family = AF_INET6;
-    pton_res = inet_pton(AF_INET6, ip_address->c_str(), &to_addr6.sin6_addr);
-    to_addr6.sin6_port = htons(port);
-    socket_fd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
-  } else {
+  query_length = sizeof(struct dns_header) +
+                 build_dns_question(dns_query, dns_question);
+
+  event_assign(&this->timeout_event, eventBase, -1, 0,
+               Healthcheck_dns::timeout_callback, this);
+
+  uring_request.callback = Healthcheck_dns::uring_send_callback;
+  uring_request.arg = this;
+  uring_iov.iov_base = query_packet;
+  uring_iov.iov_len = query_length;
+  memset(&uring_msg, 0, sizeof(uring_msg));
+  uring_msg.msg_name = &address;
+  uring_msg.msg_namelen = address_len;
+  uring_msg.msg_iov = &uring_iov;
+  uring_msg.msg_iovlen = 1;
+}
+
+/// Probes can be shared only by checks sending the same query.
+string Healthcheck_dns::get_probe_key() {
+  return Healthcheck::get_probe_key() +
+         fmt::sprintf(" port: %d query: %s", port, dns_query);
+}
+
+/// A common initializator for all healthchecks of dns type.
+///
+/// Should be called once at the startup of testtool.
+int Healthcheck_dns::initialize() {
+  random_generator.seed(std::random_device()());
+
+  socket4_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (socket4_fd == -1) {
+    log(MessageType::MSG_CRIT,
+        fmt::sprintf("dns socket4() error: %s", strerror(errno)));
     return false;
   }
 
-  if (socket_fd == -1) {
-    log(MessageType::MSG_CRIT, this,
-        fmt::sprintf("socket(): error %s", strerror(errno)));
+  socket6_fd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+  if (socket6_fd == -1) {
+    log(MessageType::MSG_CRIT,
+        fmt::sprintf("dns socket6() error: %s", strerror(errno)));
     return false;
   }
 
-  evutil_make_socket_nonblocking(socket_fd);
+  // Replies for all checks arrive on those sockets, the default buffer
+  // would lose them.
+  int newbuf = 262144;
+  for (int socket_fd : {socket4_fd, socket6_fd}) {
+    evutil_make_socket_nonblocking(socket_fd);
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &newbuf, sizeof(int)) <
+        0) {
+      log(MessageType::MSG_CRIT,
+          fmt::sprintf("dns sockopt buffer error: %s", strerror(errno)));
+      return false;
+    }
+  }
 
-  // Sending to host is one thing, but we want answers only from
-  // our target in this socket.  "connect" makes the socket
-  // receive only traffic from that host.
+#ifdef __linux__
+  // The sockets are not connected, so ICMP errors such as port unreachable
+  // are reported only through the error queue.
+  int on = 1;
+  if (setsockopt(socket4_fd, IPPROTO_IP, IP_RECVERR, &on, sizeof(int)) < 0 ||
+      setsockopt(socket6_fd, IPPROTO_IPV6, IPV6_RECVERR, &on, sizeof(int)) <
+          0) {
+    log(MessageType::MSG_CRIT,
+        fmt::sprintf("dns sockopt recverr error: %s", strerror(errno)));
+    return false;
+  }
+#endif
+
+  // Create events and make them pending.
+  ev4 = event_new(eventBase, socket4_fd, EV_READ | EV_PERSIST,
+                  Healthcheck_dns::callback, NULL);
+  event_add(ev4, NULL);
+  ev6 = event_new(eventBase, socket6_fd, EV_READ | EV_PERSIST,
+                  Healthcheck_dns::callback, NULL);
+  event_add(ev6, NULL);
+
+  return true;
+}
+
+/// A common "destructor" for all healthchecks of dns type.
+///
+/// Should be called when testtool terminates.
+void Healthcheck_dns::destroy() {
+  event_del(ev4);
+  event_free(ev4);
+  close(socket4_fd);
+
+  event_del(ev6);
+  event_free(ev6);
+  close(socket6_fd);
+}
 
-  if (address_family == AF_INET) {
-    connect(socket_fd, (struct sockaddr *)&to_addr4, sizeof(to_addr4));
-  } else if (address_family == AF_INET6) {
-    connect(socket_fd, (struct sockaddr *)&to_addr6, sizeof(to_addr6));
+/// Build key for mapping replies to checks
+///
+/// It consists of IP address, port and transaction id, which are the only
+/// things identifying a reply on the shared socket.
+string Healthcheck_dns::query_key(const struct sockaddr *addr, uint16_t qid) {
+  string key((const char *)&qid, sizeof(qid));
+  if (addr->sa_family == AF_INET) {
+    const struct sockaddr_in *addr4 = (const struct sockaddr_in *)addr;
+    key.append((const char *)&addr4->sin_port, sizeof(addr4->sin_port));
+    key.append((const char *)&addr4->sin_addr, sizeof(addr4->sin_addr));
+  } else if (addr->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)addr;
+    key.append((const char *)&addr6->sin6_port, sizeof(addr6->sin6_port));
+    key.append((const char *)&addr6->sin6_addr, sizeof(addr6->sin6_addr));
   }
+  return key;
+}
+
+int Healthcheck_dns::schedule_healthcheck(struct timespec *now) {
+  // Peform general stuff for scheduled healthcheck
+  if (Healthcheck::schedule_healthcheck(now) == false)
+    return false;
+
+  // Pick a random transaction id which is not in use for this server.
+  do {
+    my_transaction_id = random_generator() & 0xffff;
+    my_query_key = query_key((struct sockaddr *)&address, my_transaction_id);
+  } while (queries.count(my_query_key));
+  queries[my_query_key] = this;
 
-  // Create an event and make it pending
-  this->ev =
-      event_new(eventBase, socket_fd, EV_READ, Healthcheck_dns::callback, this);
-  event_add(this->ev, &this->timeout);
+  struct dns_header *dns_query_struct = (struct dns_header *)query_packet;
+  dns_query_struct->qid = htons(my_transaction_id);
 
-  // On connected socket we use send, not sendto.
-  if (send(socket_fd, (void *)raw_packet, total_length, 0) < 0)
+  event_add(&this->timeout_event, this->get_common_timeout(eventBase));
+
+  int socket_fd = (address_family == AF_INET) ? socket4_fd : socket6_fd;
+
+  // The query is sent together with the others after the scheduler pass.
+  // Should the ring be full, it is sent right away.
+  if (Uring::is_enabled() &&
+      Uring::sendmsg(&uring_request, socket_fd, &uring_msg))
+    return true;
+
+  if (sendto(socket_fd, (void *)query_packet, query_length, 0,
+             (struct sockaddr *)&address, address_len) < 0) {
+    this->end_check(HealthcheckResult::HC_FAIL,
+                    fmt::sprintf("sendto() error: %s", strerror(errno)));
     return false;
+  }
 
   return true;
 }
@@ -193,61 +282,156 @@ static unsigned int build_dns_question(string &dns_query,
   return origlen + 5;
 }
 
-/// The callback function for DNS check
+/// The callback function for DNS sockets
+///
+/// Replies for all checks are received on shared sockets.  All waiting
+/// replies are read, each one is mapped to its check by source address and
+/// transaction id.  Replies which can't be mapped are ignored.  This results
+/// in check's timeout.
 void Healthcheck_dns::callback(evutil_socket_t socket_fd, short what,
                                void *arg) {
-  Healthcheck_dns *healthcheck = (Healthcheck_dns *)arg;
+  // Make compiler happy
+  (void)(arg);
 
   char raw_packet[DNS_BUFFER_SIZE];
+  struct sockaddr_storage from_addr;
+  socklen_t from_addr_len;
   int bytes_received;
   struct dns_header *dns_query_struct = (struct dns_header *)raw_packet;
-  string message = "bad event";
-  HealthcheckResult result = HealthcheckResult::HC_PANIC;
-
-  // Prepare memory
-  memset(&raw_packet, 0, sizeof(raw_packet));
-
-  if (what & EV_TIMEOUT) {
-    result = HealthcheckResult::HC_FAIL;
-    message = fmt::sprintf("timeout after %dms", healthcheck->timeout_to_ms());
-  } else if (what & EV_READ) {
-    bytes_received = recv(socket_fd, &raw_packet, DNS_BUFFER_SIZE, 0);
-
-    if (bytes_received == -1) {
-      // This happens when the target host is not in the arp table and
-      // therefore nothing was ever sent to it. Although sending send() returns
-      // no error. Or when an ICMP dst unreachable is received.
-      result = HealthcheckResult::HC_FAIL;
-      message = "connection refused";
-    } else if (bytes_received < (int)sizeof(struct dns_header) ||
-               bytes_received > DNS_BUFFER_SIZE) {
-      // Size of the received message shall be between the size of header and
-      // the maximum dns packet size.
-      result = HealthcheckResult::HC_FAIL;
-      message = "received malformed data";
-    } else if (ntohs(dns_query_struct->ancount) == 0) {
+
+  // There should be no other event types. Pending errors are reported by
+  // some backends as both read and write readiness.
+  if (!(what & EV_READ))
+    return;
+
+#ifdef __linux__
+  handle_error_queue(socket_fd);
+#endif
+
+  while (true) {
+    from_addr_len = sizeof(from_addr);
+    bytes_received = recvfrom(socket_fd, &raw_packet, DNS_BUFFER_SIZE, 0,
+                              (struct sockaddr *)&from_addr, &from_addr_len);
+
+    // The socket is drained.
+    if (bytes_received == -1)
+      return;
+
+    // Size of the received message shall be at least the size of header.
+    // Without header the reply can't be mapped to any check.
+    if (bytes_received < (int)sizeof(struct dns_header))
+      continue;
+
+    auto query = queries.find(query_key((struct sockaddr *)&from_addr,
+                                        ntohs(dns_query_struct->qid)));
+    if (query == queries.end())
+      continue;
+    Healthcheck_dns *healthcheck = query->second;
+
+    if (ntohs(dns_query_struct->ancount) == 0) {
       // No answers means that the server knows nothing about the domain.
       // Therefore it fails the check.
-      result = HealthcheckResult::HC_FAIL;
-      message = "received no DNS answers";
-    } else if (ntohs(dns_query_struct->qid) != healthcheck->my_transaction_id) {
-      // Received transaction id must be the same as in the last query sent to
-      // the server.
-      result = HealthcheckResult::HC_FAIL;
-      message = "received wrong transaction id";
+      healthcheck->end_check(HealthcheckResult::HC_FAIL,
+                             "received no DNS answers");
     } else {
       // Finally, it seems that all is fine.
-      result = HealthcheckResult::HC_PASS;
-      message = "received a DNS answer";
-
+      //
       // We do not really check the contents of the answer sections.
       // Seeing that there is any answer given, we assume that the DNS server
       // functions properly.
+      healthcheck->end_check(HealthcheckResult::HC_PASS,
+                             "received a DNS answer");
     }
   }
+}
+
+#ifdef __linux__
+/// Reads ICMP errors from the error queue of a DNS socket
+///
+/// The kernel returns the query which has caused the error together with its
+/// destination, so the error can be mapped to the check the same way as a
+/// reply.
+void Healthcheck_dns::handle_error_queue(evutil_socket_t socket_fd) {
+  char raw_packet[DNS_BUFFER_SIZE];
+  char control[128];
+  struct sockaddr_storage destination;
+  struct dns_header *dns_query_struct = (struct dns_header *)raw_packet;
+  struct iovec iov = {raw_packet, sizeof(raw_packet)};
+  struct msghdr msg_hdr;
+
+  while (true) {
+    memset(&msg_hdr, 0, sizeof(msg_hdr));
+    msg_hdr.msg_name = &destination;
+    msg_hdr.msg_namelen = sizeof(destination);
+    msg_hdr.msg_iov = &iov;
+    msg_hdr.msg_iovlen = 1;
+    msg_hdr.msg_control = control;
+    msg_hdr.msg_controllen = sizeof(control);
+
+    ssize_t bytes_received =
+        recvmsg(socket_fd, &msg_hdr, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (bytes_received == -1)
+      return;
+    if (bytes_received < (ssize_t)sizeof(struct dns_header))
+      continue;
+
+    struct sock_extended_err *ee = NULL;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg_hdr); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg_hdr, cmsg)) {
+      if ((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) ||
+          (cmsg->cmsg_level == IPPROTO_IPV6 &&
+           cmsg->cmsg_type == IPV6_RECVERR))
+        ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+    }
+    if (ee == NULL || (ee->ee_origin != SO_EE_ORIGIN_ICMP &&
+                       ee->ee_origin != SO_EE_ORIGIN_ICMP6))
+      continue;
+
+    auto query = queries.find(query_key((struct sockaddr *)&destination,
+                                        ntohs(dns_query_struct->qid)));
+    if (query == queries.end())
+      continue;
+
+    // The kernel has translated the ICMP error to errno.
+    query->second->end_check(HealthcheckResult::HC_FAIL,
+                             fmt::sprintf("ICMP error: %s",
+                                          strerror(ee->ee_errno)));
+  }
+}
+#endif
+
+/// io_uring callback for the query sent
+///
+/// The reply might have been handled already, there is something to do
+/// only if sending has failed.
+void Healthcheck_dns::uring_send_callback(int result, void *arg) {
+  Healthcheck_dns *healthcheck = (Healthcheck_dns *)arg;
+
+  if (result < 0 && healthcheck->is_running)
+    healthcheck->end_check(
+        HealthcheckResult::HC_FAIL,
+        fmt::sprintf("sendto() error: %s", strerror(-result)));
+}
+
+/// The timeout callback for DNS check
+void Healthcheck_dns::timeout_callback(evutil_socket_t fd, short what,
+                                       void *arg) {
+  // Make compiler happy
+  (void)(fd);
+  (void)(what);
+
+  Healthcheck_dns *healthcheck = (Healthcheck_dns *)arg;
+
+  healthcheck->end_check(
+      HealthcheckResult::HC_FAIL,
+      fmt::sprintf("timeout after %dms", healthcheck->timeout_to_ms()));
+}
+
+/// Overrides end_check() method to clean up things
+void Healthcheck_dns::end_check(HealthcheckResult result, string message) {
+  // Remove the mapping, so that a reply coming after timeout won't match.
+  queries.erase(my_query_key);
+  event_del(&this->timeout_event);
 
-  // Be sure to free the memory
-  event_free(healthcheck->ev);
-  close(socket_fd);
-  healthcheck->end_check(result, message);
+  Healthcheck::end_check(result, message);
 }
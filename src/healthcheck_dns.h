@@ -11,11 +11,14 @@
 #include <event2/event_struct.h>
 #include <event2/util.h>
 #include <nlohmann/json.hpp>
+#include <random>
 #include <sstream>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 #include "healthcheck.h"
+#include "uring.h"
 
 // According to RFC1035 4.2.1:
 // Messages carried by UDP are restricted to 512 bytes (not counting the IP or
@@ -61,23 +64,47 @@ class Healthcheck_dns : public Healthcheck {
 public:
   Healthcheck_dns(const nlohmann::json &config, class LbNode *_parent_lbnode,
                   string *ip_address);
+  static int initialize();
+  static void destroy();
 
 protected:
   static void callback(evutil_socket_t fd, short what, void *arg);
+  static void timeout_callback(evutil_socket_t fd, short what, void *arg);
+  static void uring_send_callback(int result, void *arg);
+  static void handle_error_queue(evutil_socket_t socket_fd);
+  static string query_key(const struct sockaddr *addr, uint16_t qid);
+  void end_check(HealthcheckResult result, string message);
+  string get_probe_key();
 
 public:
   int schedule_healthcheck(struct timespec *now);
 
   // Members
 private:
-  int socket_fd;
-  struct event *ev;
+  struct event timeout_event; // Embedded and reused for each run.
   int port;
   string dns_query;
+  char query_packet[DNS_BUFFER_SIZE]; // Built once, only qid changes.
+  unsigned int query_length;
 
-  // Each check is run with different transaction id.
+  // The query is sent through io_uring if it is enabled.
+  struct UringRequest uring_request;
+  struct msghdr uring_msg;
+  struct iovec uring_iov;
+
+  // Each check is run with a random transaction id.
   uint16_t my_transaction_id;
-  static uint16_t global_transaction_id;
+  string my_query_key;
+
+  // All DNS checks share one UDP socket per address family.  Replies are
+  // mapped back to the check which sent the query by the address they came
+  // from and their transaction id.
+  static int socket4_fd;
+  static int socket6_fd;
+  static struct event *ev4;
+  static struct event *ev6;
+  static unordered_map<string, Healthcheck_dns *> queries;
+  static std::mt19937 random_generator;
 };
 
 #endif
@@ -16,6 +16,7 @@
 #include "lb_node.h"
 #include "lb_pool.h"
 #include "msg.h"
+#include "time_helper.h"
 
 using namespace std;
 
@@ -25,6 +26,7 @@ Healthcheck_dummy::Healthcheck_dummy(const nlohmann::json &config,
                                      string *ip_address)
     : Healthcheck(config, _parent_lbnode, ip_address) {
   type = "dummy";
+  socket = safe_get<bool>(config, "hc_dummy_socket", false);
 }
 
 // Libecent callback for Dummy healthcheck.
@@ -49,3 +51,20 @@ void Healthcheck_dummy::dummy_end_check(HealthcheckResult result,
                                         string message) {
   end_check(result, message);
 }
+
+/// Ends the check as if its probe had started given time ago (ms).
+void Healthcheck_dummy::dummy_end_check(HealthcheckResult result,
+                                        string message, int latency) {
+  clock_gettime(CLOCK_MONOTONIC, &last_checked);
+  timespec_add_ms(&last_checked, -latency);
+  end_check(result, message);
+}
+
+/// Time from the start of the last run until the next one is due (ms).
+int Healthcheck_dummy::dummy_next_due_ms() {
+  return timespec_diff_ms(&next_due, &last_checked);
+}
+
+bool Healthcheck_dummy::dummy_is_running() { return is_running; }
+
+bool Healthcheck_dummy::opens_probe_socket() { return socket; }
@@ -25,9 +25,19 @@ public:
   static void check_dummy_callback(struct evtcp_request *req, void *arg);
   int schedule_healthcheck(struct timespec *now);
   void dummy_end_check(HealthcheckResult result, string message);
+  void dummy_end_check(HealthcheckResult result, string message,
+                       int latency);
+  int dummy_next_due_ms();
+  bool dummy_is_running();
 
 protected:
+  bool opens_probe_socket();
+
   static void callback(evutil_socket_t fd, short what, void *arg);
+
+  // Members
+private:
+  bool socket; // Pretend to open a probe socket in each run.
 };
 
 #endif
@@ -7,7 +7,6 @@
 #define FMT_HEADER_ONLY
 
 #include <boost/algorithm/string/join.hpp>
-#include <boost/algorithm/string/replace.hpp>
 #include <errno.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -15,6 +14,7 @@
 #include <fmt/format.h>
 #include <fmt/printf.h>
 #include <iostream>
+#include <map>
 #include <nlohmann/json.hpp>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
@@ -34,6 +34,12 @@ extern struct event_base *eventBase;
 extern SSL_CTX *sctx;
 extern int verbose;
 
+// In the .h file there are only declarations of static variables, here we have
+// definitions.
+vector<struct event_base *> Healthcheck_https::worker_bases;
+vector<std::thread> Healthcheck_https::worker_threads;
+unsigned int Healthcheck_https::next_worker = 0;
+
 /// Constructor for HTTP healthcheck.
 ///
 /// Parses http(s)-specific parameters.
@@ -43,6 +49,9 @@ Healthcheck_http::Healthcheck_http(const nlohmann::json &config,
     : Healthcheck(config, _parent_lbnode, ip_address) {
   // This is not done automatically.
   bev = NULL;
+  uring_socket = -1;
+  uring_input = NULL;
+  uring_request.arg = this;
 
   // Set defaults
   this->type = safe_get<string>(config, "hc_type", "http");
@@ -81,63 +90,205 @@ Healthcheck_http::Healthcheck_http(const nlohmann::json &config,
     host = "[" + *ip_address + "]";
   }
 
-  // Copy address to addrinfo struct for connect
-  //
-  // I am aware that converting port number to text and back to int is stupid.
-  memset(&addrinfo, 0, sizeof(addrinfo));
-  char port_str[256];
-  memset(port_str, 0, sizeof(port_str));
-  snprintf(port_str, sizeof(port_str), "%d", port);
-  getaddrinfo(ip_address->c_str(), port_str, NULL, &addrinfo);
+  this->set_address_port(port);
 
   this->log_prefix = fmt::sprintf(
       "query: '%s' port: %d ok_codes: %s drain_codes: %s", this->query,
       this->port, boost::algorithm::join(this->ok_codes, ","),
       boost::algorithm::join(this->drain_codes, ","));
+
+  this->compile_query_template();
 }
 
 /// Constructor for HTTPS healthcheck
 ///
-/// It only calls HTTP constructor.  Now that's what I call inheritance!
+/// Apart from calling HTTP constructor nothing is done, the check is bound to
+/// one of TLS workers by init_probe().  Without workers the check runs on the
+/// main event base.
 Healthcheck_https::Healthcheck_https(const nlohmann::json &config,
                                      class LbNode *_parent_lbnode,
                                      string *ip_address)
     : Healthcheck_http(config, _parent_lbnode, ip_address) {
-  // Nothing to do. Due to constructor calling order default port
-  // must be specified in parent class.
-}
+  // Due to constructor calling order default port must be specified in
+  // parent class.
 
-string Healthcheck_http::parse_query_template() {
-  string new_query = string(this->query);
+  worker_base = NULL;
+  start_event = NULL;
+  done_event = NULL;
+}
 
-  boost::replace_all(new_query, "{POOL_NAME}",
-                     this->parent_lbnode->parent_lbpool->name);
-  if (this->address_family == AF_INET)
-    boost::replace_all(new_query, "{POOL_ADDRESS}",
-                       this->parent_lbnode->parent_lbpool->ipv4_address);
+/// Binds the check to one of TLS workers, followers need none.
+void Healthcheck_https::init_probe() {
+  if (worker_bases.empty())
+    worker_base = eventBase;
   else
-    boost::replace_all(new_query, "{POOL_ADDRESS}",
-                       this->parent_lbnode->parent_lbpool->ipv6_address);
-  boost::replace_all(new_query, "{NODE_NAME}", this->parent_lbnode->name);
-  boost::replace_all(new_query, "{NODE_ADDRESS}", *this->ip_address);
-
-  string joined_up_nodes_names = boost::algorithm::join(
-      this->parent_lbnode->parent_lbpool->get_up_nodes_names(), ",");
-  boost::replace_all(new_query, "{ACTIVE_NODES_NAMES}", joined_up_nodes_names);
-
-  vector<std::string> up_nodes_addresses;
-  for (LbNode *node : this->parent_lbnode->parent_lbpool->get_up_nodes()) {
-    if (!node->ipv4_address.empty())
-      up_nodes_addresses.push_back(node->ipv4_address);
-    if (!node->ipv6_address.empty())
-      up_nodes_addresses.push_back(node->ipv6_address);
+    worker_base = worker_bases[next_worker++ % worker_bases.size()];
+
+  start_event = event_new(worker_base, -1, 0,
+                          &Healthcheck_https::start_callback, this);
+  done_event =
+      event_new(eventBase, -1, 0, &Healthcheck_https::done_callback, this);
+}
+
+/// A common initializator for all healthchecks of https type.
+///
+/// Frees events of the check, only checks running the probe have them.
+Healthcheck_https::~Healthcheck_https() {
+  if (start_event != NULL)
+    event_free(start_event);
+  if (done_event != NULL)
+    event_free(done_event);
+}
+
+/// Starts given number of TLS worker threads, each with its own event base.
+/// Should be called once at the startup of testtool, after libevent threading
+/// support is enabled and before any https check is created.
+int Healthcheck_https::initialize(int workers) {
+  for (int i = 0; i < workers; i++) {
+    struct event_base *base = event_base_new();
+    if (base == NULL) {
+      log(MessageType::MSG_CRIT,
+          fmt::sprintf("TLS worker %d: event_base_new() failed", i));
+      return false;
+    }
+    worker_bases.push_back(base);
+    worker_threads.push_back(std::thread([base]() {
+      event_base_loop(base, EVLOOP_NO_EXIT_ON_EMPTY);
+    }));
+  }
+  log(MessageType::MSG_DEBUG,
+      fmt::sprintf("TLS workers initialized: %d", workers));
+  return true;
+}
+
+/// A common "destructor" for all healthchecks of https type.
+///
+/// Should be called when testtool terminates.
+void Healthcheck_https::destroy() {
+  for (auto base : worker_bases)
+    event_base_loopbreak(base);
+  for (auto &thread : worker_threads)
+    thread.join();
+  for (auto base : worker_bases)
+    event_base_free(base);
+  worker_bases.clear();
+  worker_threads.clear();
+}
+
+/// Compile the query template into segments of the request.
+///
+/// Macros which never change for the lifetime of the check are expanded
+/// right away.  Only the lists of active LB Nodes stay as separate segments,
+/// everything else including the request headers is merged into literals.
+void Healthcheck_http::compile_query_template() {
+  LbPool *lbpool = this->parent_lbnode->parent_lbpool;
+  map<string, string> static_macros = {
+      {"{POOL_NAME}", lbpool->name},
+      {"{POOL_ADDRESS}", this->address_family == AF_INET
+                             ? lbpool->ipv4_address
+                             : lbpool->ipv6_address},
+      {"{NODE_NAME}", this->parent_lbnode->name},
+      {"{NODE_ADDRESS}", *this->ip_address},
+  };
+  map<string, QuerySegmentType> dynamic_macros = {
+      {"{ACTIVE_NODES_NAMES}", QuerySegmentType::ACTIVE_NODES_NAMES},
+      {"{ACTIVE_NODES_ADDRESSES}", QuerySegmentType::ACTIVE_NODES_ADDRESSES},
+  };
+  string literal;
+  size_t pos = 0;
+
+  query_segments.clear();
+  while (pos < query.size()) {
+    size_t macro_start = query.find('{', pos);
+    size_t macro_end = string::npos;
+    if (macro_start != string::npos)
+      macro_end = query.find('}', macro_start);
+    if (macro_end == string::npos) {
+      literal += query.substr(pos);
+      break;
+    }
+
+    literal += query.substr(pos, macro_start - pos);
+    string macro = query.substr(macro_start, macro_end - macro_start + 1);
+    pos = macro_end + 1;
+
+    if (static_macros.count(macro)) {
+      literal += static_macros[macro];
+    } else if (dynamic_macros.count(macro)) {
+      query_segments.push_back({QuerySegmentType::LITERAL, literal});
+      query_segments.push_back({dynamic_macros[macro], ""});
+      literal.clear();
+    } else {
+      // Unknown macros are sent as they are.
+      literal += macro;
+    }
+  }
+
+  literal += fmt::sprintf(" HTTP/1.1\r\nHost: %s\r\nUser-Agent: %s\r\n"
+                          "Connection: close\r\n\r\n",
+                          this->host, HC_UA);
+  query_segments.push_back({QuerySegmentType::LITERAL, literal});
+
+  request.clear();
+}
+
+/// Render the full HTTP request to be sent by this run of the check.
+///
+/// The request is kept between runs.  It is rendered again only if it
+/// contains lists of active LB Nodes and those have changed since.
+void Healthcheck_http::build_request() {
+  LbPool *lbpool = this->parent_lbnode->parent_lbpool;
+
+  if (!request.empty() && (query_segments.size() == 1 ||
+                           request_generation == lbpool->up_nodes_generation))
+    return;
+
+  request.clear();
+  for (auto &segment : query_segments) {
+    switch (segment.type) {
+    case QuerySegmentType::LITERAL:
+      request += segment.text;
+      break;
+    case QuerySegmentType::ACTIVE_NODES_NAMES:
+      request += boost::algorithm::join(lbpool->get_up_nodes_names(), ",");
+      break;
+    case QuerySegmentType::ACTIVE_NODES_ADDRESSES: {
+      bool first = true;
+      for (LbNode *node : lbpool->get_up_nodes()) {
+        for (string *address : {&node->ipv4_address, &node->ipv6_address}) {
+          if (address->empty())
+            continue;
+          if (!first)
+            request += ",";
+          request += *address;
+          first = false;
+        }
+      }
+      break;
+    }
+    }
   }
-  string joined_up_nodes_addresses =
-      boost::algorithm::join(up_nodes_addresses, ",");
-  boost::replace_all(new_query, "{ACTIVE_NODES_ADDRESSES}",
-                     joined_up_nodes_addresses);
+  request_generation = lbpool->up_nodes_generation;
+}
 
-  return new_query;
+/// Probes can be shared only by checks sending the same request and
+/// expecting the same codes.
+///
+/// Lists of active LB Nodes differ between LB Pools, checks using them are
+/// never shared between LB Pools.
+string Healthcheck_http::get_probe_key() {
+  string key = Healthcheck::get_probe_key() +
+               fmt::sprintf(" port: %d host: %s ok_codes: %s drain_codes: %s "
+                            "query:",
+                            port, host, boost::algorithm::join(ok_codes, ","),
+                            boost::algorithm::join(drain_codes, ","));
+  for (auto &segment : query_segments) {
+    if (segment.type == QuerySegmentType::LITERAL)
+      key += " " + segment.text;
+    else
+      key += " " + this->parent_lbnode->parent_lbpool->name;
+  }
+  return key;
 }
 
 int Healthcheck_http::schedule_healthcheck(struct timespec *now) {
@@ -145,10 +296,19 @@ int Healthcheck_http::schedule_healthcheck(struct timespec *now) {
   if (Healthcheck::schedule_healthcheck(now) == false)
     return false;
 
-  reply = "";
-  string new_query = this->parse_query_template();
+  this->build_request();
+
+  if (Uring::is_enabled())
+    return this->schedule_uring();
+
+  evutil_socket_t fd = open_probe_socket();
+  if (fd == -1) {
+    this->end_check(HealthcheckResult::HC_FAIL,
+                    fmt::sprintf("socket() error: %s", strerror(errno)));
+    return false;
+  }
 
-  bev = bufferevent_socket_new(eventBase, -1, 0 | BEV_OPT_CLOSE_ON_FREE);
+  bev = bufferevent_socket_new(eventBase, fd, 0 | BEV_OPT_CLOSE_ON_FREE);
   if (bev == NULL) {
     throw HealthcheckSchedulingException(
         fmt::sprintf("bufferevent_socket_new errno %d", errno));
@@ -156,63 +316,306 @@ int Healthcheck_http::schedule_healthcheck(struct timespec *now) {
 
   bufferevent_setcb(bev, &read_callback, NULL, &event_callback, this);
   bufferevent_enable(bev, EV_READ | EV_WRITE);
-  evbuffer_add_printf(
-      bufferevent_get_output(bev),
-      "%s HTTP/1.1\r\nHost: %s\r\nUser-Agent: %s\r\nConnection: close\r\n\r\n",
-      new_query.c_str(), this->host.c_str(), HC_UA);
+  // The request is kept until the next run, it needs no copying.
+  evbuffer_add_reference(bufferevent_get_output(bev), request.data(),
+                         request.size(), NULL, NULL);
 
-  bufferevent_set_timeouts(bev, &this->timeout, &this->timeout);
+  const struct timeval *timeout = this->get_common_timeout(eventBase);
+  bufferevent_set_timeouts(bev, timeout, timeout);
 
   // Ignore connection errors. They will be handled by event callback later.
-  bufferevent_socket_connect(bev, addrinfo->ai_addr, addrinfo->ai_addrlen);
+  bufferevent_socket_connect(bev, (struct sockaddr *)&address, address_len);
 
   return true;
 }
 
-int Healthcheck_https::schedule_healthcheck(struct timespec *now) {
-  SSL *ssl;
+/// Queues a connection attempt to io_uring
+///
+/// Sending the request and receiving the reply follow as separate
+/// operations, each limited by the time left of the check timeout.
+int Healthcheck_http::schedule_uring() {
+  uring_socket = open_probe_socket();
+  if (uring_socket == -1) {
+    this->end_check(HealthcheckResult::HC_FAIL,
+                    fmt::sprintf("socket() error: %s", strerror(errno)));
+    return false;
+  }
+  uring_input = evbuffer_new();
+  uring_sent = 0;
+
+  uring_request.callback = Healthcheck_http::uring_connect_callback;
+  // The check has just started, all of its timeout is left.
+  if (!Uring::connect(&uring_request, uring_socket,
+                      (struct sockaddr *)&address, address_len,
+                      &this->timeout)) {
+    this->end_check(HealthcheckResult::HC_FAIL, "io_uring queue full");
+    return false;
+  }
+  return true;
+}
+
+/// Each run uses its own connection.
+bool Healthcheck_http::opens_probe_socket() { return true; }
+
+/// Common part of io_uring callbacks, returns false if the check has failed
+static bool uring_result_ok(Healthcheck_http *hc, int result,
+                            string &message) {
+  if (result == -ECANCELED) {
+    message = fmt::sprintf("timeout after %dms", hc->timeout_to_ms());
+    return false;
+  }
+  if (result < 0) {
+    message = fmt::sprintf("socket error: %s", strerror(-result));
+    return false;
+  }
+  return true;
+}
+
+void Healthcheck_http::uring_connect_callback(int result, void *arg) {
+  Healthcheck_http *hc = (Healthcheck_http *)arg;
+  string message;
+
+  result = Uring::connect_result(result, hc->uring_socket);
+  if (!uring_result_ok(hc, result, message))
+    return hc->finish_probe(HealthcheckResult::HC_FAIL, message);
+
+  hc->uring_send();
+}
+
+/// Sends the rest of the request
+void Healthcheck_http::uring_send() {
+  struct timeval left;
+  if (!get_time_left(&left))
+    return finish_probe(HealthcheckResult::HC_FAIL,
+                        fmt::sprintf("timeout after %dms", timeout_to_ms()));
+
+  uring_request.callback = Healthcheck_http::uring_send_callback;
+  if (!Uring::send(&uring_request, uring_socket, request.data() + uring_sent,
+                   request.size() - uring_sent, &left))
+    finish_probe(HealthcheckResult::HC_FAIL, "io_uring queue full");
+}
+
+void Healthcheck_http::uring_send_callback(int result, void *arg) {
+  Healthcheck_http *hc = (Healthcheck_http *)arg;
+  string message;
+
+  if (!uring_result_ok(hc, result, message))
+    return hc->finish_probe(HealthcheckResult::HC_FAIL, message);
+
+  hc->uring_sent += result;
+  if (hc->uring_sent < hc->request.size())
+    return hc->uring_send();
+
+  hc->uring_recv();
+}
+
+/// Receives the next part of the reply straight into the input buffer
+void Healthcheck_http::uring_recv() {
+  struct timeval left;
+  if (!get_time_left(&left))
+    return finish_probe(HealthcheckResult::HC_FAIL,
+                        fmt::sprintf("timeout after %dms", timeout_to_ms()));
+
+  if (evbuffer_reserve_space(uring_input, HTTP_STATUS_LINE_MAX + 1,
+                             &uring_space, 1) < 1)
+    return finish_probe(HealthcheckResult::HC_FAIL,
+                        "evbuffer_reserve_space() error");
+
+  uring_request.callback = Healthcheck_http::uring_recv_callback;
+  if (!Uring::recv(&uring_request, uring_socket, uring_space.iov_base,
+                   uring_space.iov_len, &left))
+    finish_probe(HealthcheckResult::HC_FAIL, "io_uring queue full");
+}
+
+/// io_uring callback for received part of the reply
+///
+/// Just like read_callback() and event_callback() together, the reply is
+/// inspected as it arrives.
+void Healthcheck_http::uring_recv_callback(int result, void *arg) {
+  Healthcheck_http *hc = (Healthcheck_http *)arg;
+  string message;
+
+  if (!uring_result_ok(hc, result, message))
+    return hc->finish_probe(HealthcheckResult::HC_FAIL, message);
+
+  hc->uring_space.iov_len = result;
+  evbuffer_commit_space(hc->uring_input, &hc->uring_space, 1);
+
+  // The connection was closed before the status line was complete.
+  // Parse whatever has arrived.
+  if (result == 0) {
+    hc->parse_status_line(hc->uring_input, true);
+    return;
+  }
+
+  if (!hc->parse_status_line(hc->uring_input, false))
+    hc->uring_recv();
+}
 
+/// Schedule HTTPS healthcheck
+///
+/// The request is rendered here, as it needs state of LB Pool which belongs
+/// to the main loop.  Everything else is handed over to the TLS worker.
+int Healthcheck_https::schedule_healthcheck(struct timespec *now) {
   // Peform general stuff for scheduled healthcheck
   if (Healthcheck::schedule_healthcheck(now) == false)
     return false;
 
-  reply = "";
-  string new_query = this->parse_query_template();
+  this->build_request();
+
+  // Common timeouts are per event base, get the one of our worker.
+  worker_timeout = this->get_common_timeout(worker_base);
+
+  event_active(start_event, EV_TIMEOUT, 0);
+
+  return true;
+}
+
+/// Start HTTPS healthcheck, runs in TLS worker thread.
+void Healthcheck_https::start_callback(evutil_socket_t fd, short what,
+                                       void *arg) {
+  // Make compiler happy
+  (void)(fd);
+  (void)(what);
+
+  Healthcheck_https *hc = (Healthcheck_https *)arg;
+  SSL *ssl;
+
+  evutil_socket_t probe_socket = hc->open_probe_socket();
+  if (probe_socket == -1) {
+    return hc->finish_probe(
+        HealthcheckResult::HC_FAIL,
+        fmt::sprintf("socket() error: %s", strerror(errno)));
+  }
 
   ssl = SSL_new(sctx);
-  bev = bufferevent_openssl_socket_new(eventBase, -1, ssl,
-                                       BUFFEREVENT_SSL_CONNECTING,
-                                       0 | BEV_OPT_CLOSE_ON_FREE);
-  if (bev == NULL) {
-    throw HealthcheckSchedulingException(
-        fmt::sprintf("bufferevent_socket_new errno %d", errno));
+  hc->bev = bufferevent_openssl_socket_new(hc->worker_base, probe_socket, ssl,
+                                           BUFFEREVENT_SSL_CONNECTING,
+                                           0 | BEV_OPT_CLOSE_ON_FREE);
+  if (hc->bev == NULL) {
+    return hc->finish_probe(
+        HealthcheckResult::HC_PANIC,
+        fmt::sprintf("bufferevent_openssl_socket_new errno %d", errno));
   }
 
-  bufferevent_setcb(bev, &read_callback, NULL, &event_callback, this);
-  bufferevent_enable(bev, EV_READ | EV_WRITE);
-  evbuffer_add_printf(
-      bufferevent_get_output(bev),
-      "%s HTTP/1.1\r\nHost: %s\r\nUser-Agent: %s\r\nConnection: close\r\n\r\n",
-      new_query.c_str(), this->host.c_str(), HC_UA);
+  bufferevent_setcb(hc->bev, &read_callback, NULL, &event_callback, hc);
+  bufferevent_enable(hc->bev, EV_READ | EV_WRITE);
+  // The request is kept until the next run, it needs no copying.
+  evbuffer_add_reference(bufferevent_get_output(hc->bev), hc->request.data(),
+                         hc->request.size(), NULL, NULL);
 
-  bufferevent_set_timeouts(bev, &this->timeout, &this->timeout);
+  bufferevent_set_timeouts(hc->bev, hc->worker_timeout, hc->worker_timeout);
 
   // Ignore connection errors. They will be handled by event callback later.
-  bufferevent_socket_connect(bev, addrinfo->ai_addr, addrinfo->ai_addrlen);
+  bufferevent_socket_connect(hc->bev, (struct sockaddr *)&hc->address,
+                             hc->address_len);
+}
 
-  return true;
+/// Hand over the result of HTTPS healthcheck, runs in TLS worker thread.
+///
+/// The connection is closed by the worker which owns it, the result is
+/// processed by the main loop.
+void Healthcheck_https::finish_probe(HealthcheckResult result,
+                                     string message) {
+  this->free_bev(result, message);
+  worker_result = result;
+  worker_message = message;
+  event_active(done_event, EV_TIMEOUT, 0);
 }
 
+/// Receive the result of HTTPS healthcheck, runs in main loop.
+void Healthcheck_https::done_callback(evutil_socket_t fd, short what,
+                                      void *arg) {
+  // Make compiler happy
+  (void)(fd);
+  (void)(what);
+
+  Healthcheck_https *hc = (Healthcheck_https *)arg;
+  hc->Healthcheck::end_check(hc->worker_result, hc->worker_message);
+}
+
+/// Libevent read callback for HTTP healthcheck.
+///
+/// The reply is inspected in place as it arrives.  As soon as the status line
+/// is complete the result is known and the check is finished, which closes
+/// the connection without downloading the rest of the reply.
 void Healthcheck_http::read_callback(struct bufferevent *bev, void *arg) {
-  struct evbuffer *input = bufferevent_get_input(bev);
   Healthcheck_http *hc = (Healthcheck_http *)arg;
-  char buf[1024];
 
-  memset(buf, 0, sizeof(buf));
+  hc->parse_status_line(bufferevent_get_input(bev), false);
+}
+
+/// Parse HTTP status line from the beginning of input buffer.
+///
+/// Returns false if the status line is not complete yet and more data is
+/// needed.  Otherwise the probe is finished.  If at_eof is given, the status
+/// line which is not terminated is parsed as is.
+bool Healthcheck_http::parse_status_line(struct evbuffer *input, bool at_eof) {
+  struct evbuffer_ptr eol;
+  size_t eol_len;
+  ssize_t line_len;
+
+  eol = evbuffer_search_eol(input, NULL, &eol_len, EVBUFFER_EOL_CRLF);
+  if (eol.pos >= 0) {
+    line_len = eol.pos;
+  } else if (evbuffer_get_length(input) > HTTP_STATUS_LINE_MAX) {
+    finish_probe(HealthcheckResult::HC_FAIL, "status line too long");
+    return true;
+  } else if (at_eof) {
+    line_len = evbuffer_get_length(input);
+  } else {
+    return false;
+  }
+
+  if (line_len > HTTP_STATUS_LINE_MAX) {
+    finish_probe(HealthcheckResult::HC_FAIL, "status line too long");
+    return true;
+  }
+
+  if (line_len == 0) {
+    finish_probe(HealthcheckResult::HC_FAIL, "no HTTP status line");
+    return true;
+  }
 
-  while (evbuffer_remove(input, buf, sizeof(buf) > 0)) {
-    hc->reply.append(buf);
+  // This first line goes like this:
+  //
+  //	HTTP/1.1 200 OK
+  //
+  // HTTP code is the string between 1st and 2nd " ".  The line is usually
+  // in the first chunk of the buffer, so the pullup does not copy anything.
+  const char *line = (const char *)evbuffer_pullup(input, line_len);
+  if (line_len < 5 || memcmp(line, "HTTP/", 5) != 0) {
+    finish_probe(HealthcheckResult::HC_FAIL, "no HTTP status line");
+    return true;
   }
+  const char *end = line + line_len;
+  const char *code = (const char *)memchr(line, ' ', line_len);
+  if (code == NULL) {
+    code = end;
+  } else {
+    code++;
+  }
+  const char *code_end = (const char *)memchr(code, ' ', end - code);
+  if (code_end == NULL)
+    code_end = end;
+
+  string statusline(code, code_end - code);
+  string message = fmt::sprintf("HTTP code %s", statusline);
+
+  for (auto drain_code : drain_codes)
+    if (statusline.compare(drain_code) == 0) {
+      finish_probe(HealthcheckResult::HC_DRAIN, message);
+      return true;
+    }
+
+  for (auto ok_code : ok_codes)
+    if (statusline.compare(ok_code) == 0) {
+      finish_probe(HealthcheckResult::HC_PASS, message);
+      return true;
+    }
+
+  finish_probe(HealthcheckResult::HC_FAIL, message);
+  return true;
 }
 
 /// Libevent callback for HTTP healthcheck.
@@ -231,12 +634,12 @@ void Healthcheck_http::event_callback(struct bufferevent *bev, short events,
 
   if (events & BEV_EVENT_TIMEOUT) {
     message = fmt::sprintf("timeout after %dms", hc->timeout_to_ms());
-    return hc->end_check(HealthcheckResult::HC_FAIL, message);
+    return hc->finish_probe(HealthcheckResult::HC_FAIL, message);
   }
 
   if (events & BEV_EVENT_ERROR) {
     if (hc->type == "https")
-      return hc->end_check(
+      return hc->finish_probe(
           HealthcheckResult::HC_FAIL,
           fmt::sprintf(
               "bev error: %s openssl error: %s",
@@ -244,45 +647,28 @@ void Healthcheck_http::event_callback(struct bufferevent *bev, short events,
                   evutil_socket_geterror(bufferevent_getfd(bev))),
               ERR_reason_error_string(bufferevent_get_openssl_error(bev))));
     else
-      return hc->end_check(
+      return hc->finish_probe(
           HealthcheckResult::HC_FAIL,
           fmt::sprintf("bev error: %s",
                        evutil_socket_error_to_string(
                            evutil_socket_geterror(bufferevent_getfd(bev)))));
   }
 
-  // Get 1st line of reply
-  stringstream replystream(hc->reply);
-  string statusline;
-  getline(replystream, statusline);
-
-  // This first line goes like this:
-  //
-  //	HTTP/1.1 200 OK
-  //
-  // HTTP code is the string between 1st and 2nd " ".
-
-  int pos;
-  pos = statusline.find(" ");
-  statusline = statusline.substr(pos + 1);
-  pos = statusline.find(" ");
-  statusline = statusline.substr(0, pos);
-
-  message = fmt::sprintf("HTTP code %s", statusline);
-
-  for (auto drain_code : hc->drain_codes)
-    if (statusline.compare(drain_code) == 0)
-      return hc->end_check(HealthcheckResult::HC_DRAIN, message);
-
-  for (auto ok_code : hc->ok_codes)
-    if (statusline.compare(ok_code) == 0)
-      return hc->end_check(HealthcheckResult::HC_PASS, message);
+  // The connection was closed before the status line was complete.
+  // Parse whatever has arrived.
+  hc->parse_status_line(bufferevent_get_input(bev), true);
+}
 
-  return hc->end_check(HealthcheckResult::HC_FAIL, message);
+/// Finish the probe once its result is known.
+///
+/// For plain HTTP it is the same as end_check(), HTTPS hands the result over
+/// from TLS worker to the main loop.
+void Healthcheck_http::finish_probe(HealthcheckResult result, string message) {
+  this->end_check(result, message);
 }
 
-/// Overrides end_check() method to clean up things
-void Healthcheck_http::end_check(HealthcheckResult result, string message) {
+/// Free the bufferevent of finished check, adding socket error to message.
+void Healthcheck_http::free_bev(HealthcheckResult result, string &message) {
   if (verbose >= 2 && result != HealthcheckResult::HC_PASS &&
       this->bev != NULL) {
     char *error = evutil_socket_error_to_string(evutil_socket_geterror());
@@ -292,9 +678,23 @@ void Healthcheck_http::end_check(HealthcheckResult result, string message) {
   }
 
   if (this->bev != NULL) {
-    bufferevent_free(this->bev);
+    this->free_probe_bufferevent(this->bev);
     this->bev = NULL;
   }
+}
+
+/// Overrides end_check() method to clean up things
+void Healthcheck_http::end_check(HealthcheckResult result, string message) {
+  this->free_bev(result, message);
+
+  if (this->uring_socket != -1) {
+    this->close_probe_socket(this->uring_socket);
+    this->uring_socket = -1;
+  }
+  if (this->uring_input != NULL) {
+    evbuffer_free(this->uring_input);
+    this->uring_input = NULL;
+  }
 
   Healthcheck::end_check(result, message);
 }
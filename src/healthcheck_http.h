@@ -7,17 +7,35 @@
 #ifndef _CHECK_HTTP_HPP_
 #define _CHECK_HTTP_HPP_
 
+#include <event2/buffer.h>
 #include <event2/http.h>
 #include <event2/http_struct.h>
 #include <nlohmann/json.hpp>
 #include <openssl/ssl.h>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include "healthcheck.h"
+#include "uring.h"
 
 #define HC_UA "testtool"
 
+// Reply with status line longer than this is treated as not real HTTP.
+#define HTTP_STATUS_LINE_MAX 1024
+
+// Parts of compiled query template
+enum class QuerySegmentType {
+  LITERAL,
+  ACTIVE_NODES_NAMES,
+  ACTIVE_NODES_ADDRESSES,
+};
+
+struct QuerySegment {
+  QuerySegmentType type;
+  string text; // Only for literals
+};
+
 class Healthcheck_http : public Healthcheck {
 
   // Methods
@@ -30,19 +48,38 @@ public:
 protected:
   static void event_callback(struct bufferevent *bev, short events, void *arg);
   static void read_callback(struct bufferevent *bev, void *arg);
+  static void uring_connect_callback(int result, void *arg);
+  static void uring_send_callback(int result, void *arg);
+  static void uring_recv_callback(int result, void *arg);
+  int schedule_uring();
+  void uring_send();
+  void uring_recv();
+  bool parse_status_line(struct evbuffer *input, bool at_eof);
+  virtual void finish_probe(HealthcheckResult result, string message);
   void end_check(HealthcheckResult result, string message);
-  string parse_query_template();
+  void free_bev(HealthcheckResult result, string &message);
+  void compile_query_template();
+  void build_request();
+  string get_probe_key();
+  bool opens_probe_socket();
 
   // Members
 protected:
   bufferevent *bev;
+  // Connection driven by io_uring instead of bufferevent.
+  evutil_socket_t uring_socket;
+  struct UringRequest uring_request;
+  size_t uring_sent;          // Part of the request sent so far.
+  struct evbuffer *uring_input; // The reply received so far.
+  struct evbuffer_iovec uring_space; // Where the next part is received.
+  string request; // Full HTTP request, kept between runs.
+  unsigned long request_generation; // State of LB Pool request was built for.
+  vector<QuerySegment> query_segments;
   string query;
   string host;
   int port;
   vector<string> ok_codes;
   vector<string> drain_codes;
-  struct addrinfo *addrinfo;
-  string reply;
 };
 
 class Healthcheck_https : public Healthcheck_http {
@@ -51,7 +88,32 @@ class Healthcheck_https : public Healthcheck_http {
 public:
   Healthcheck_https(const nlohmann::json &config, class LbNode *_parent_lbnode,
                     string *ip_address);
+  ~Healthcheck_https();
   int schedule_healthcheck(struct timespec *now);
+  static int initialize(int workers);
+  static void destroy();
+
+protected:
+  void finish_probe(HealthcheckResult result, string message);
+  void init_probe();
+  static void start_callback(evutil_socket_t fd, short what, void *arg);
+  static void done_callback(evutil_socket_t fd, short what, void *arg);
+
+  // Members
+private:
+  // TLS handshakes and record processing are done by worker threads, each
+  // running its own event base.  The main loop only renders the request and
+  // receives the result, so crypto does not delay other checks.
+  static vector<struct event_base *> worker_bases;
+  static vector<std::thread> worker_threads;
+  static unsigned int next_worker;
+
+  struct event_base *worker_base; // Event base of the worker running us.
+  struct event *start_event;      // Activated by main loop, run by worker.
+  struct event *done_event;       // Activated by worker, run by main loop.
+  const struct timeval *worker_timeout;
+  HealthcheckResult worker_result;
+  string worker_message;
 };
 
 #endif
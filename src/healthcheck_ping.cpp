@@ -22,6 +22,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <vector>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 
 #include "healthcheck.h"
 #include "healthcheck_ping.h"
@@ -37,13 +40,17 @@ extern int verbose;
 
 // In the .h file there are only declarations of static variables, here we have
 // definitions.
-int Healthcheck_ping::socket4_fd;
-int Healthcheck_ping::socket6_fd;
-struct event *Healthcheck_ping::ev4;
-struct event *Healthcheck_ping::ev6;
+vector<struct PingSocket *> Healthcheck_ping::sockets4;
+vector<struct PingSocket *> Healthcheck_ping::sockets6;
+unsigned int Healthcheck_ping::next_socket = 0;
+bool Healthcheck_ping::dgram_mode = false;
 uint16_t Healthcheck_ping::ping_id;
-uint16_t Healthcheck_ping::ping_global_seq = 0;
-Healthcheck_ping **Healthcheck_ping::seq_map;
+vector<struct mmsghdr> Healthcheck_ping::send_msgs;
+vector<struct iovec> Healthcheck_ping::send_iovecs;
+unsigned char (*Healthcheck_ping::recv_packets)[PING_RECV_SIZE];
+unsigned char (*Healthcheck_ping::recv_controls)[PING_CONTROL_SIZE];
+struct mmsghdr *Healthcheck_ping::recv_msgs;
+struct iovec *Healthcheck_ping::recv_iovecs;
 
 #define OFFSETOF(type, field) ((unsigned long)&(((type *)0)->field))
 
@@ -86,69 +93,186 @@ u_short in_cksum(u_short *addr, int len) {
   return (answer);
 }
 
-/// A common initializator for all healthchecks of ping type.
+/// Opens ping sockets of given type for one address family
 ///
-/// Should be called once at the startup of testtool.
-int Healthcheck_ping::initialize() {
-  int sockopt;
-
-  // So I was told that using the pid number for ping id is the Unix Way
-  ping_id = getpid();
-
-  // Allocate memory for seq map.
-  seq_map = (Healthcheck_ping **)calloc(1 << (sizeof(uint16_t) * 8),
-                                        sizeof(Healthcheck_ping *));
-
-  // Create sockets for both protocols.
-  socket4_fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-  if (socket4_fd == -1) {
-    log(MessageType::MSG_CRIT,
-        fmt::sprintf("socket4() error: %s", strerror(errno)));
-    return false;
+/// Sockets are appended to sockets4 or sockets6. Returns false if any socket
+/// could not be created, errno is then left as set by socket().
+bool Healthcheck_ping::open_sockets(int family, int type, int count) {
+  vector<struct PingSocket *> &sockets =
+      (family == AF_INET) ? sockets4 : sockets6;
+  int protocol;
+  if (family == AF_INET)
+    protocol = IPPROTO_ICMP;
+  else
+    protocol = IPPROTO_ICMPV6;
+
+  for (int i = 0; i < count; i++) {
+    int fd = socket(family, type, protocol);
+    if (fd == -1)
+      return false;
+    struct PingSocket *ping_socket = new PingSocket();
+    ping_socket->fd = fd;
+    ping_socket->family = family;
+    ping_socket->ev = NULL;
+    sockets.push_back(ping_socket);
   }
+  return true;
+}
 
-  // Create sockets for both protocols.
-  struct icmp6_filter filterv6;
-  ICMP6_FILTER_SETBLOCKALL(&filterv6);
-  ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &filterv6);
-  ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filterv6);
-  socket6_fd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
-  if (socket6_fd == -1) {
-    log(MessageType::MSG_CRIT,
-        fmt::sprintf("socket6() error: %s", strerror(errno)));
-    return false;
-  }
-  sockopt = setsockopt(socket6_fd, IPPROTO_ICMPV6, ICMP6_FILTER, &filterv6,
-                       sizeof(filterv6));
+/// Sets socket options of a ping socket and makes its event pending
+int Healthcheck_ping::setup_socket(struct PingSocket *ping_socket) {
+  int sockopt;
+
+  // The default 9kB buffer loses some packets. Replies to a whole batch of
+  // requests arrive at once, so ask for much more. Without privileges the
+  // kernel limits it to net.core.rmem_max.
+  int newbuf = PING_RCVBUF_SIZE;
+  sockopt = -1;
+#ifdef SO_RCVBUFFORCE
+  sockopt = setsockopt(ping_socket->fd, SOL_SOCKET, SO_RCVBUFFORCE, &newbuf,
+                       sizeof(int));
+#endif
+  if (sockopt < 0)
+    sockopt = setsockopt(ping_socket->fd, SOL_SOCKET, SO_RCVBUF, &newbuf,
+                         sizeof(int));
   if (sockopt < 0) {
     log(MessageType::MSG_CRIT,
-        fmt::sprintf("sockopt IPv6 filter error: %s", strerror(errno)));
+        fmt::sprintf("sockopt buffer error: %s", strerror(errno)));
     return false;
   }
-  log(MessageType::MSG_DEBUG, fmt::sprintf("protocols initialized"));
 
-  // The default 9kB buffer loses some packets.
-  int newbuf = 262144;
-  sockopt = setsockopt(socket4_fd, SOL_SOCKET, SO_RCVBUF, &newbuf, sizeof(int));
+#ifdef SO_TIMESTAMPNS
+  // Let the kernel tell when the reply has arrived, not when we got to
+  // read it.
+  int on = 1;
+  sockopt = setsockopt(ping_socket->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on,
+                       sizeof(int));
   if (sockopt < 0) {
     log(MessageType::MSG_CRIT,
-        fmt::sprintf("sockopt IPv4 buffer error: %s", strerror(errno)));
+        fmt::sprintf("sockopt timestamp error: %s", strerror(errno)));
     return false;
   }
-  sockopt = setsockopt(socket6_fd, SOL_SOCKET, SO_RCVBUF, &newbuf, sizeof(int));
-  if (sockopt < 0) {
-    log(MessageType::MSG_CRIT,
-        fmt::sprintf("sockopt IPv6 buffer error: %s", strerror(errno)));
-    return false;
+#endif
+
+#ifdef __linux__
+  // Datagram sockets receive ICMP errors only through the error queue.
+  if (dgram_mode) {
+    int on = 1;
+    if (ping_socket->family == AF_INET)
+      sockopt = setsockopt(ping_socket->fd, IPPROTO_IP, IP_RECVERR, &on,
+                           sizeof(int));
+    else
+      sockopt = setsockopt(ping_socket->fd, IPPROTO_IPV6, IPV6_RECVERR, &on,
+                           sizeof(int));
+    if (sockopt < 0) {
+      log(MessageType::MSG_CRIT,
+          fmt::sprintf("sockopt recverr error: %s", strerror(errno)));
+      return false;
+    }
   }
+#endif
 
   // Create an event and make it pending.
-  ev4 = event_new(eventBase, socket4_fd, EV_READ | EV_PERSIST,
-                  Healthcheck_ping::callback, NULL);
-  event_add(ev4, NULL);
-  ev6 = event_new(eventBase, socket6_fd, EV_READ | EV_PERSIST,
-                  Healthcheck_ping::callback, NULL);
-  event_add(ev6, NULL);
+  ping_socket->ev = event_new(eventBase, ping_socket->fd, EV_READ | EV_PERSIST,
+                              Healthcheck_ping::callback, ping_socket);
+  event_add(ping_socket->ev, NULL);
+
+  return true;
+}
+
+/// A common initializator for all healthchecks of ping type.
+///
+/// Should be called once at the startup of testtool. On Linux unprivileged
+/// ICMP datagram sockets are used if the system permits it, dgram_shards
+/// of them for each address family. Otherwise there is a single raw socket
+/// for each address family.
+int Healthcheck_ping::initialize(int dgram_shards) {
+  int sockopt;
+
+  // So I was told that using the pid number for ping id is the Unix Way
+  ping_id = getpid();
+
+  // Allocate buffers for receiving batches of packets. Each message gets
+  // its own slot in the packet slab, they are not zeroed before reuse.
+  recv_packets = (unsigned char(*)[PING_RECV_SIZE])malloc(PING_BATCH_SIZE *
+                                                          PING_RECV_SIZE);
+  recv_controls = (unsigned char(*)[PING_CONTROL_SIZE])malloc(
+      PING_BATCH_SIZE * PING_CONTROL_SIZE);
+  recv_msgs =
+      (struct mmsghdr *)calloc(PING_BATCH_SIZE, sizeof(struct mmsghdr));
+  recv_iovecs = (struct iovec *)calloc(PING_BATCH_SIZE, sizeof(struct iovec));
+  for (int i = 0; i < PING_BATCH_SIZE; i++) {
+    recv_iovecs[i].iov_base = recv_packets[i];
+    recv_iovecs[i].iov_len = PING_RECV_SIZE;
+    recv_msgs[i].msg_hdr.msg_iov = &recv_iovecs[i];
+    recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    recv_msgs[i].msg_hdr.msg_control = recv_controls[i];
+    recv_msgs[i].msg_hdr.msg_controllen = PING_CONTROL_SIZE;
+  }
+
+#ifdef __linux__
+  // ICMP datagram sockets don't need root. The kernel sets ICMP id and
+  // checksum and delivers only replies to our own requests on each socket,
+  // so they can be sharded without seeing each other's replies. They are
+  // allowed only for groups in net.ipv4.ping_group_range.
+  if (dgram_shards > 0 && open_sockets(AF_INET, SOCK_DGRAM, dgram_shards) &&
+      open_sockets(AF_INET6, SOCK_DGRAM, dgram_shards)) {
+    dgram_mode = true;
+  } else {
+    if (dgram_shards > 0)
+      log(MessageType::MSG_INFO,
+          fmt::sprintf("ICMP datagram sockets not available: %s, "
+                       "falling back to raw sockets",
+                       strerror(errno)));
+    for (auto *sockets : {&sockets4, &sockets6}) {
+      for (auto *ping_socket : *sockets) {
+        close(ping_socket->fd);
+        delete ping_socket;
+      }
+      sockets->clear();
+    }
+  }
+#else
+  (void)(dgram_shards);
+#endif
+
+  // Create sockets for both protocols.
+  if (!dgram_mode) {
+    if (!open_sockets(AF_INET, SOCK_RAW, 1)) {
+      log(MessageType::MSG_CRIT,
+          fmt::sprintf("socket4() error: %s", strerror(errno)));
+      return false;
+    }
+    if (!open_sockets(AF_INET6, SOCK_RAW, 1)) {
+      log(MessageType::MSG_CRIT,
+          fmt::sprintf("socket6() error: %s", strerror(errno)));
+      return false;
+    }
+
+    // Raw sockets receive all ICMPv6 traffic of the system.
+    struct icmp6_filter filterv6;
+    ICMP6_FILTER_SETBLOCKALL(&filterv6);
+    ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &filterv6);
+    ICMP6_FILTER_SETPASS(ICMP6_TIME_EXCEEDED, &filterv6);
+    ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filterv6);
+    sockopt = setsockopt(sockets6[0]->fd, IPPROTO_ICMPV6, ICMP6_FILTER,
+                         &filterv6, sizeof(filterv6));
+    if (sockopt < 0) {
+      log(MessageType::MSG_CRIT,
+          fmt::sprintf("sockopt IPv6 filter error: %s", strerror(errno)));
+      return false;
+    }
+  }
+  log(MessageType::MSG_DEBUG,
+      fmt::sprintf("protocols initialized, %s sockets: %d",
+                   dgram_mode ? "datagram" : "raw", sockets4.size()));
+
+  for (auto *sockets : {&sockets4, &sockets6}) {
+    for (auto *ping_socket : *sockets) {
+      if (!setup_socket(ping_socket))
+        return false;
+    }
+  }
 
   return true;
 }
@@ -157,15 +281,22 @@ int Healthcheck_ping::initialize() {
 ///
 /// Should be called when testtool terminates.
 void Healthcheck_ping::destroy() {
-  event_del(ev4);
-  event_free(ev4);
-  close(socket4_fd);
-
-  event_del(ev6);
-  event_free(ev6);
-  close(socket6_fd);
+  for (auto *sockets : {&sockets4, &sockets6}) {
+    for (auto *ping_socket : *sockets) {
+      event_del(ping_socket->ev);
+      event_free(ping_socket->ev);
+      close(ping_socket->fd);
+      for (auto *slot : ping_socket->slots)
+        delete slot;
+      delete ping_socket;
+    }
+    sockets->clear();
+  }
 
-  free(seq_map);
+  free(recv_packets);
+  free(recv_controls);
+  free(recv_msgs);
+  free(recv_iovecs);
 }
 
 /// Constructor for ping healthcheck.
@@ -177,51 +308,241 @@ Healthcheck_ping::Healthcheck_ping(const nlohmann::json &config,
     : Healthcheck(config, _parent_lbnode, ip_address) {
   // Oh wait, there are none for this healthcheck!
   type = "ping";
+  this->set_address_port(0);
+  this->ping_socket = NULL;
+}
+
+/// Followers never send requests, only checks running the probe get a slot.
+void Healthcheck_ping::init_probe() { assign_slot(); }
+
+/// Assigns socket, ICMP id and Sequence Number to this healthcheck
+///
+/// Datagram sockets have a single id slot each. Checks are spread over them
+/// and if all of them are full, a new socket is opened. A raw socket gets
+/// another slot with the next id once all Sequence Numbers are taken.
+void Healthcheck_ping::assign_slot() {
+  vector<struct PingSocket *> &sockets =
+      (address_family == AF_INET) ? sockets4 : sockets6;
+  struct PingIdSlot *slot = NULL;
+
+  ping_socket = NULL;
+  if (sockets.empty())
+    return;
+
+  if (dgram_mode) {
+    for (size_t i = 0; i < sockets.size() && slot == NULL; i++) {
+      struct PingSocket *candidate = sockets[next_socket++ % sockets.size()];
+      if (candidate->slots.empty())
+        candidate->slots.push_back(new PingIdSlot());
+      if (candidate->slots[0]->checks.size() < PING_SLOT_SIZE) {
+        ping_socket = candidate;
+        slot = candidate->slots[0];
+      }
+    }
+    if (slot == NULL) {
+      if (!open_sockets(address_family, SOCK_DGRAM, 1) ||
+          !setup_socket(sockets.back())) {
+        log(MessageType::MSG_CRIT, this,
+            fmt::sprintf("can't open another ping socket: %s",
+                         strerror(errno)));
+        return;
+      }
+      ping_socket = sockets.back();
+      slot = new PingIdSlot();
+      ping_socket->slots.push_back(slot);
+    }
+  } else {
+    ping_socket = sockets[0];
+    if (ping_socket->slots.empty() ||
+        ping_socket->slots.back()->checks.size() >= PING_SLOT_SIZE) {
+      slot = new PingIdSlot();
+      slot->id = ping_id + ping_socket->slots.size();
+      ping_socket->slots.push_back(slot);
+    }
+    slot = ping_socket->slots.back();
+  }
+
+  ping_my_id = slot->id;
+  ping_my_seq = slot->checks.size();
+  slot->checks.push_back(this);
 }
 
 /// Libevent callback for ping healthcheck
 ///
-/// Unfortunately for ping checks there is only one socket so it is impossible
-/// to pass a Healthcheck object related to a given event. Therefore this
-/// callback function must parse the received packet and map it to one of
-/// Healthcheck objects. Should such parsing or mapping be impossible, due to
-/// some transmission errors or unknown types of packet received (only Echo
-/// Reply and Destination Unreachable are analyzed), this callback returns
-/// without handling healthcheck result. This results in Healthcheck's timeout.
+/// Unfortunately for ping checks a socket is shared by many checks so it is
+/// impossible to pass a Healthcheck object related to a given event.
+/// Therefore this callback function reads all pending packets in batches and
+/// hands each one over to handle_packet() to be mapped to one of Healthcheck
+/// objects.
 void Healthcheck_ping::callback(evutil_socket_t socket_fd, short what,
                                 void *arg) {
-  // Make compiler happy
-  (void)(arg);
-
-  Healthcheck_ping *healthcheck = NULL;
-  unsigned char raw_packet[IP_MAXPACKET];
-  struct ip *ip4_packet;
-  ssize_t ip_header_len;
-  union icmp_echo *icmp_packet;
+  struct PingSocket *ping_socket = (struct PingSocket *)arg;
   struct timespec now;
-  ssize_t received_bytes;
-  string message;
-  uint16_t recvd_seq, recvd_id;
+  int received;
 
-  // There should be no other event types.
-  if (what != EV_READ)
+  // There should be no other event types. Pending errors are reported by
+  // some backends as both read and write readiness.
+  if (!(what & EV_READ))
     return;
 
-  clock_gettime(CLOCK_MONOTONIC, &now);
+#ifdef __linux__
+  if (dgram_mode)
+    handle_error_queue(ping_socket);
+#endif
+
+  // Sockets stay blocking for sending, but reading never waits. It goes on
+  // until there is nothing more to read.
+  while (true) {
+#ifdef HAVE_MMSG
+    received =
+        recvmmsg(socket_fd, recv_msgs, PING_BATCH_SIZE, MSG_DONTWAIT, NULL);
+#else
+    ssize_t received_bytes =
+        recvmsg(socket_fd, &recv_msgs[0].msg_hdr, MSG_DONTWAIT);
+    if (received_bytes >= 0)
+      recv_msgs[0].msg_len = received_bytes;
+    received = received_bytes < 0 ? -1 : 1;
+#endif
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        log(MessageType::MSG_CRIT,
+            fmt::sprintf("recvmmsg() error: %s", strerror(errno)));
+      return;
+    }
 
-  // Prepare place for receiving data.
-  memset(raw_packet, 0, sizeof(raw_packet));
+    // Packets without kernel timestamp are timed when the batch was read.
+    // Echo Requests carry wall clock time because kernel timestamps do so.
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    for (int i = 0; i < received; i++) {
+      struct msghdr *msg_hdr = &recv_msgs[i].msg_hdr;
+      struct timespec *received_time = &now;
+#ifdef SO_TIMESTAMPNS
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg_hdr); cmsg != NULL;
+           cmsg = CMSG_NXTHDR(msg_hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPNS)
+          received_time = (struct timespec *)CMSG_DATA(cmsg);
+      }
+#endif
+      handle_packet(ping_socket, recv_packets[i], recv_msgs[i].msg_len,
+                    received_time);
+
+      // The kernel has shrunk it to the size of data it has stored.
+      msg_hdr->msg_controllen = PING_CONTROL_SIZE;
+    }
+  }
+}
 
-  // Read a packet from the socket.
-  received_bytes =
-      recvfrom(socket_fd, raw_packet, sizeof(raw_packet), 0, NULL, NULL);
-  if (received_bytes <= 0) {
-    log(MessageType::MSG_CRIT,
-        fmt::sprintf("recvfrom() error: %s", strerror(errno)));
+/// Finds the check which sent given Echo Request
+///
+/// The request is either the one reflected in Echo Reply or the one quoted
+/// in an ICMP error. Returns NULL if it is not a request of any running
+/// check. If the request is not truncated, its timestamp must match the last
+/// request sent by the check.
+Healthcheck_ping *Healthcheck_ping::match_request(
+    struct PingSocket *ping_socket, union icmp_echo *echo, ssize_t echo_len) {
+  bool is_ipv4 = (ping_socket->family == AF_INET);
+
+  // Both ICMP versions have id and seq at the same place.
+  if (echo_len < ICMP_MINLEN)
+    return NULL;
+  uint16_t recvd_id = ntohs(echo->icmp4.icmp_header.icmp_id);
+  uint16_t recvd_seq = ntohs(echo->icmp4.icmp_header.icmp_seq);
+
+  // Is it addressed to us? Raw sockets use consecutive ids starting with
+  // ping_id, the kernel does it for datagram sockets.
+  uint16_t slot_index = dgram_mode ? 0 : (uint16_t)(recvd_id - ping_id);
+  if (slot_index >= ping_socket->slots.size())
+    return NULL;
+
+  // Now let's map the received packet to a Healthcheck_icmp object.
+  struct PingIdSlot *slot = ping_socket->slots[slot_index];
+  if (recvd_seq >= slot->checks.size())
+    return NULL;
+  Healthcheck_ping *healthcheck = slot->checks[recvd_seq];
+  if (!healthcheck->is_running)
+    return NULL;
+
+  // Ignore replies to earlier requests of this check, which have already
+  // timed out, and foreign packets which happen to have our id and seq.
+  ssize_t echo_size =
+      is_ipv4 ? sizeof(struct icmp4_echo) : sizeof(struct icmp6_echo);
+  struct timespec *sent_time =
+      is_ipv4 ? &echo->icmp4.timestamp : &echo->icmp6.timestamp;
+  struct timespec *my_sent_time =
+      is_ipv4 ? &healthcheck->echo_request.icmp4.timestamp
+              : &healthcheck->echo_request.icmp6.timestamp;
+  if (echo_len >= echo_size &&
+      memcmp(sent_time, my_sent_time, sizeof(struct timespec)) != 0)
+    return NULL;
+
+  return healthcheck;
+}
+
+/// Checks if given IP address is the one this check sends requests to
+bool Healthcheck_ping::is_my_address(const void *ip_address) {
+  if (address_family == AF_INET)
+    return memcmp(ip_address, &((struct sockaddr_in *)&address)->sin_addr,
+                  sizeof(struct in_addr)) == 0;
+  return memcmp(ip_address, &((struct sockaddr_in6 *)&address)->sin6_addr,
+                sizeof(struct in6_addr)) == 0;
+}
+
+/// Describes ICMP error which was received in response to an Echo Request
+string Healthcheck_ping::icmp_error_message(bool is_ipv4, int type,
+                                            int code) {
+  if (is_ipv4 && type == ICMP_UNREACH) {
+    switch (code) {
+    case ICMP_UNREACH_NET:
+      return "ICMP network unreachable";
+    case ICMP_UNREACH_HOST:
+      return "ICMP host unreachable";
+    case ICMP_UNREACH_NET_PROHIB:
+    case ICMP_UNREACH_HOST_PROHIB:
+    case ICMP_UNREACH_FILTER_PROHIB:
+      return "ICMP administratively prohibited";
+    }
+    return fmt::sprintf("ICMP destination unreachable, code %d", code);
   }
+  if (!is_ipv4 && type == ICMP6_DST_UNREACH) {
+    switch (code) {
+    case ICMP6_DST_UNREACH_NOROUTE:
+      return "ICMP6 no route to destination";
+    case ICMP6_DST_UNREACH_ADMIN:
+      return "ICMP6 administratively prohibited";
+    case ICMP6_DST_UNREACH_ADDR:
+      return "ICMP6 address unreachable";
+    }
+    return fmt::sprintf("ICMP6 destination unreachable, code %d", code);
+  }
+  if (is_ipv4)
+    return fmt::sprintf("ICMP time exceeded, code %d", code);
+  return fmt::sprintf("ICMP6 time exceeded, code %d", code);
+}
+
+/// Parses a received packet and finishes the check it belongs to
+///
+/// Echo Reply passes the check. Destination Unreachable or Time Exceeded
+/// quoting our Echo Request fails it. Should such parsing or mapping be
+/// impossible, due to some transmission errors or unknown types of packet
+/// received, the packet is ignored. This results in Healthcheck's timeout.
+void Healthcheck_ping::handle_packet(struct PingSocket *ping_socket,
+                                     unsigned char *raw_packet,
+                                     ssize_t received_bytes,
+                                     struct timespec *now) {
+  Healthcheck_ping *healthcheck = NULL;
+  struct ip *ip4_packet;
+  ssize_t ip_header_len;
+  union icmp_echo *icmp_packet;
+  string message;
 
-  // Calculate offset to ICMP in IP
-  if (socket_fd == socket4_fd) {
+  bool is_ipv4 = (ping_socket->family == AF_INET);
+
+  // Calculate offset to ICMP in IP, datagram sockets give no IP header.
+  if (is_ipv4 && !dgram_mode) {
+    if (received_bytes < (ssize_t)sizeof(struct ip))
+      return;
     ip4_packet = (struct ip *)raw_packet;
     // IHL is the number of 32-bit words, multiply it by 4 to get bytes.
     ip_header_len = ip4_packet->ip_hl << 2;
@@ -229,51 +550,46 @@ void Healthcheck_ping::callback(evutil_socket_t socket_fd, short what,
     ip_header_len = 0;
   }
 
+  // Buffers are not cleared between packets, don't look at stale data.
+  if (received_bytes < ip_header_len + ICMP_MINLEN)
+    return;
+
   // First we must check if the received packet is:
   // - ICMP at all (can't really for IPv6)
   // - A valid ICMP packet.
-  // - Addressed to us (by ping id).
+  // - Addressed to us (by ping id, the kernel does it for datagram sockets).
   icmp_packet = (union icmp_echo *)(raw_packet + ip_header_len);
+  received_bytes -= ip_header_len;
+
+  uint8_t icmp_type = icmp_packet->icmp4.icmp_header.icmp_type;
+  uint8_t icmp_code = icmp_packet->icmp4.icmp_header.icmp_code;
 
-  if ((socket_fd == socket4_fd &&
-       icmp_packet->icmp4.icmp_header.icmp_type == ICMP_ECHOREPLY) ||
-      (socket_fd == socket6_fd &&
-       icmp_packet->icmp6.icmp6_header.icmp6_type == ICMP6_ECHO_REPLY)) {
+  if ((is_ipv4 && icmp_type == ICMP_ECHOREPLY) ||
+      (!is_ipv4 && icmp_type == ICMP6_ECHO_REPLY)) {
     // ECHO REPLY is a correct answer so it contains id and seq
     // directly in itself. No need to dig into further headers.
-    if (socket_fd == socket4_fd) {
-      if (received_bytes < ip_header_len + ICMP_MINLEN)
-        return;
-      recvd_id = icmp_packet->icmp4.icmp_header.icmp_id;
-      recvd_seq = icmp_packet->icmp4.icmp_header.icmp_seq;
-    } else {
-      if (received_bytes < (ssize_t)sizeof(struct icmp6_echo))
-        return;
-      recvd_id = icmp_packet->icmp6.icmp6_header.icmp6_id;
-      recvd_seq = icmp_packet->icmp6.icmp6_header.icmp6_seq;
-    }
-    recvd_seq = ntohs(recvd_seq);
-
-    // Is it addressed to us?
-    if (recvd_id != htons(ping_id))
+    if (received_bytes < (is_ipv4 ? (ssize_t)sizeof(struct icmp4_echo)
+                                  : (ssize_t)sizeof(struct icmp6_echo)))
       return;
 
-    // Now let's map the received packet to a Healthcheck_icmp object.
-    if (seq_map[recvd_seq] != NULL &&
-        seq_map[recvd_seq]->ping_my_seq == recvd_seq)
-      healthcheck = seq_map[recvd_seq];
-    else
+    healthcheck = match_request(ping_socket, icmp_packet, received_bytes);
+    if (healthcheck == NULL)
       return;
 
-    long int nsec_diff;
-    if (socket_fd == socket4_fd) {
-      nsec_diff =
-          (now.tv_sec - icmp_packet->icmp4.timestamp.tv_sec) * 1000000000 +
-          (now.tv_nsec - icmp_packet->icmp4.timestamp.tv_nsec);
-    } else {
-      nsec_diff =
-          (now.tv_sec - icmp_packet->icmp6.timestamp.tv_sec) * 1000000000 +
-          (now.tv_nsec - icmp_packet->icmp6.timestamp.tv_nsec);
+    struct timespec *sent_time = is_ipv4 ? &icmp_packet->icmp4.timestamp
+                                         : &icmp_packet->icmp6.timestamp;
+    long int nsec_diff = (now->tv_sec - sent_time->tv_sec) * 1000000000 +
+                         (now->tv_nsec - sent_time->tv_nsec);
+
+    // Both times are wall clock. If it was stepped in between, fall back to
+    // the monotonic time since the check was scheduled.
+    if (nsec_diff < 0 ||
+        nsec_diff > healthcheck->timeout_to_ms() * 1000000L) {
+      struct timespec mono_now;
+      clock_gettime(CLOCK_MONOTONIC, &mono_now);
+      nsec_diff = (mono_now.tv_sec - healthcheck->last_checked.tv_sec) *
+                      1000000000 +
+                  (mono_now.tv_nsec - healthcheck->last_checked.tv_nsec);
     }
 
     int ms_full = nsec_diff / 1000000;
@@ -282,9 +598,109 @@ void Healthcheck_ping::callback(evutil_socket_t socket_fd, short what,
     message = fmt::sprintf("reply after %d.%dms", ms_full, ms_dec);
 
     healthcheck->end_check(HealthcheckResult::HC_PASS, message);
+  } else if ((is_ipv4 &&
+              (icmp_type == ICMP_UNREACH || icmp_type == ICMP_TIMXCEED)) ||
+             (!is_ipv4 && (icmp_type == ICMP6_DST_UNREACH ||
+                           icmp_type == ICMP6_TIME_EXCEEDED))) {
+    // The error quotes the IP header and the beginning of the packet which
+    // caused it, the Echo Request. Datagram sockets never get those, errors
+    // come to them through the error queue.
+    unsigned char *quoted = (unsigned char *)icmp_packet + ICMP_MINLEN;
+    ssize_t quoted_len = received_bytes - ICMP_MINLEN;
+    const void *quoted_dst;
+    ssize_t quoted_header_len;
+
+    if (is_ipv4) {
+      if (quoted_len < (ssize_t)sizeof(struct ip))
+        return;
+      struct ip *quoted_ip = (struct ip *)quoted;
+      if (quoted_ip->ip_p != IPPROTO_ICMP)
+        return;
+      quoted_header_len = quoted_ip->ip_hl << 2;
+      quoted_dst = &quoted_ip->ip_dst;
+    } else {
+      if (quoted_len < (ssize_t)sizeof(struct ip6_hdr))
+        return;
+      struct ip6_hdr *quoted_ip6 = (struct ip6_hdr *)quoted;
+      if (quoted_ip6->ip6_nxt != IPPROTO_ICMPV6)
+        return;
+      quoted_header_len = sizeof(struct ip6_hdr);
+      quoted_dst = &quoted_ip6->ip6_dst;
+    }
+
+    if (quoted_len < quoted_header_len + ICMP_MINLEN)
+      return;
+    union icmp_echo *quoted_echo =
+        (union icmp_echo *)(quoted + quoted_header_len);
+    if ((is_ipv4 && quoted_echo->icmp4.icmp_header.icmp_type != ICMP_ECHO) ||
+        (!is_ipv4 &&
+         quoted_echo->icmp6.icmp6_header.icmp6_type != ICMP6_ECHO_REQUEST))
+      return;
+
+    healthcheck = match_request(ping_socket, quoted_echo,
+                                quoted_len - quoted_header_len);
+    if (healthcheck == NULL || !healthcheck->is_my_address(quoted_dst))
+      return;
+
+    healthcheck->end_check(HealthcheckResult::HC_FAIL,
+                           icmp_error_message(is_ipv4, icmp_type, icmp_code));
   }
 }
 
+#ifdef __linux__
+/// Reads ICMP errors from the error queue of a datagram socket
+///
+/// The kernel returns the Echo Request which has caused the error together
+/// with its destination and a description of the error.
+void Healthcheck_ping::handle_error_queue(struct PingSocket *ping_socket) {
+  struct msghdr *msg_hdr = &recv_msgs[0].msg_hdr;
+  struct sockaddr_storage destination;
+  bool is_ipv4 = (ping_socket->family == AF_INET);
+
+  while (true) {
+    msg_hdr->msg_name = &destination;
+    msg_hdr->msg_namelen = sizeof(destination);
+    msg_hdr->msg_controllen = PING_CONTROL_SIZE;
+    ssize_t received_bytes =
+        recvmsg(ping_socket->fd, msg_hdr, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (received_bytes < 0)
+      break;
+
+    struct sock_extended_err *ee = NULL;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg_hdr); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msg_hdr, cmsg)) {
+      if ((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) ||
+          (cmsg->cmsg_level == IPPROTO_IPV6 &&
+           cmsg->cmsg_type == IPV6_RECVERR))
+        ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+    }
+    if (ee == NULL || (ee->ee_origin != SO_EE_ORIGIN_ICMP &&
+                       ee->ee_origin != SO_EE_ORIGIN_ICMP6))
+      continue;
+
+    Healthcheck_ping *healthcheck = match_request(
+        ping_socket, (union icmp_echo *)recv_packets[0], received_bytes);
+    if (healthcheck == NULL)
+      continue;
+
+    const void *destination_address =
+        is_ipv4 ? (const void *)&((struct sockaddr_in *)&destination)->sin_addr
+                : (const void *)&((struct sockaddr_in6 *)&destination)
+                      ->sin6_addr;
+    if (!healthcheck->is_my_address(destination_address))
+      continue;
+
+    healthcheck->end_check(
+        HealthcheckResult::HC_FAIL,
+        icmp_error_message(is_ipv4, ee->ee_type, ee->ee_code));
+  }
+
+  msg_hdr->msg_name = NULL;
+  msg_hdr->msg_namelen = 0;
+  msg_hdr->msg_controllen = PING_CONTROL_SIZE;
+}
+#endif
+
 /// Finalize ping healthcheck
 ///
 /// Due to lack of possibility to use typical libevent timeout mechanism on raw
@@ -303,109 +719,132 @@ void Healthcheck_ping::finalize() {
 
   if (dt_ms > this->timeout_to_ms()) {
     message = fmt::sprintf("timeout after %d,s", this->timeout_to_ms());
-    ping_my_seq = 0;
     end_check(HealthcheckResult::HC_FAIL, message);
   }
 }
 
+/// Prepares an ICMP Echo Request for this healthcheck
+///
+/// The packet is not sent immediately. It is queued and all requests built
+/// during one scheduler pass are sent by flush().
 int Healthcheck_ping::schedule_healthcheck(struct timespec *now) {
   // Peform general stuff for scheduled healthcheck.
   if (Healthcheck::schedule_healthcheck(now) == false)
     return false;
 
-  // Increase the ICMP sequence number. It is zeroed elsewehere, so we always
-  // start with 1.
-  ping_global_seq++;
+  if (ping_socket == NULL) {
+    end_check(HealthcheckResult::HC_FAIL, "no ping socket available");
+    return false;
+  }
 
-  // Create the mapping between the ping Sequence Number and the object.
-  ping_my_seq = ping_global_seq;
-  seq_map[ping_my_seq] = this;
+  // Wall clock, to be comparable with kernel timestamps of replies.
+  struct timespec sent_time;
+  clock_gettime(CLOCK_REALTIME, &sent_time);
 
-  if (address_family == AF_INET) {
-    struct sockaddr_in to_addr;
-    struct icmp4_echo echo_request;
-
-    // Build the ICMP Echo Request packet to be send.
-    memset(&echo_request, 0, sizeof(echo_request));
+  // Build the ICMP Echo Request packet to be send.
+  memset(&echo_request, 0, sizeof(echo_request));
 
+  if (address_family == AF_INET) {
     // Fill in the headers.
-    echo_request.icmp_header.icmp_type = ICMP_ECHO;
-    echo_request.icmp_header.icmp_code = 0;
-    echo_request.icmp_header.icmp_id = htons(ping_id);
-    echo_request.icmp_header.icmp_seq = htons(ping_my_seq);
+    echo_request.icmp4.icmp_header.icmp_type = ICMP_ECHO;
+    echo_request.icmp4.icmp_header.icmp_code = 0;
+    echo_request.icmp4.icmp_header.icmp_id = htons(ping_my_id);
+    echo_request.icmp4.icmp_header.icmp_seq = htons(ping_my_seq);
 
     // Remember time when this request was sent.
-    memcpy(&echo_request.timestamp, now, sizeof(struct timespec));
+    memcpy(&echo_request.icmp4.timestamp, &sent_time, sizeof(struct timespec));
 
     // Fill in the data.
-    memcpy(echo_request.data, ICMP_FILL_DATA, ICMP_FILL_SIZE);
-
-    // Calculate packet checksum.
-    echo_request.icmp_header.icmp_cksum =
-        in_cksum((uint16_t *)&echo_request, sizeof(icmp4_echo));
-
-    // Set the to_addr, a real sockaddr_in is needed instead of strings.
-    memset(&to_addr, 0, sizeof(sockaddr_in));
-    to_addr.sin_family = AF_INET;
-    to_addr.sin_addr.s_addr = inet_addr(ip_address->c_str());
-    to_addr.sin_port = htons(0);
-
-    // Send the echo request.
-    int bsent = sendto(socket4_fd, (void *)&echo_request, sizeof(icmp4_echo), 0,
-                       (struct sockaddr *)&to_addr, sizeof(struct sockaddr_in));
-    if (bsent < 0) {
-      return false;
-    }
+    memcpy(echo_request.icmp4.data, ICMP_FILL_DATA, ICMP_FILL_SIZE);
 
+    // Calculate packet checksum. The kernel does it for datagram sockets.
+    if (!dgram_mode)
+      echo_request.icmp4.icmp_header.icmp_cksum =
+          in_cksum((uint16_t *)&echo_request.icmp4, sizeof(icmp4_echo));
   } else if (address_family == AF_INET6) {
-    struct sockaddr_in6 to_addr;
-    struct icmp6_echo echo_request;
-
-    // Build the ICMP Echo Request packet to be send.
-    memset(&echo_request, 0, sizeof(echo_request));
-
     // Fill in the headers.
-    echo_request.icmp6_header.icmp6_type = ICMP6_ECHO_REQUEST;
-    echo_request.icmp6_header.icmp6_code = 0;
-    echo_request.icmp6_header.icmp6_id = htons(ping_id);
-    echo_request.icmp6_header.icmp6_seq = htons(ping_my_seq);
+    echo_request.icmp6.icmp6_header.icmp6_type = ICMP6_ECHO_REQUEST;
+    echo_request.icmp6.icmp6_header.icmp6_code = 0;
+    echo_request.icmp6.icmp6_header.icmp6_id = htons(ping_my_id);
+    echo_request.icmp6.icmp6_header.icmp6_seq = htons(ping_my_seq);
 
     // Remember time when this request was sent.
-    memcpy(&echo_request.timestamp, now, sizeof(struct timespec));
+    memcpy(&echo_request.icmp6.timestamp, &sent_time, sizeof(struct timespec));
 
     // Fill in the data.
-    memcpy(echo_request.data, ICMP_FILL_DATA, ICMP_FILL_SIZE);
-
-    // Calculate packet checksum.
-    echo_request.icmp6_header.icmp6_cksum =
-        in_cksum((uint16_t *)&echo_request, sizeof(icmp6_echo));
-
-    // Set the to_addr, a real sockaddr_in is needed instead of strings.
-    memset(&to_addr, 0, sizeof(sockaddr_in6));
-    to_addr.sin6_family = AF_INET6;
-    inet_pton(AF_INET6, ip_address->c_str(), &to_addr.sin6_addr);
-    to_addr.sin6_port = htons(0);
-
-    // Send the echo request.
-    int bsent =
-        sendto(socket6_fd, (void *)&echo_request, sizeof(icmp6_echo), 0,
-               (struct sockaddr *)&to_addr, sizeof(struct sockaddr_in6));
-    if (bsent < 0) {
-      return false;
-    }
+    memcpy(echo_request.icmp6.data, ICMP_FILL_DATA, ICMP_FILL_SIZE);
+
+    // Calculate packet checksum. The kernel does it for datagram sockets.
+    if (!dgram_mode)
+      echo_request.icmp6.icmp6_header.icmp6_cksum =
+          in_cksum((uint16_t *)&echo_request.icmp6, sizeof(icmp6_echo));
   }
 
+  ping_socket->send_queue.push_back(this);
+
   return true;
 }
 
-/// Overrides end_check() method to clean up things
-void Healthcheck_ping::end_check(HealthcheckResult result, string message) {
+/// Sends all queued Echo Requests
+///
+/// Should be called after each scheduler pass.
+void Healthcheck_ping::flush() {
+  for (auto *sockets : {&sockets4, &sockets6}) {
+    for (auto *ping_socket : *sockets)
+      flush_queue(ping_socket);
+  }
+}
 
-  // Clean sequence mapping for this instance of Healthcheck.
-  // This is required so that ICMP Echo Reply coming after timeout
-  // won't match.
-  seq_map[this->ping_my_seq] = NULL;
+/// Sends Echo Requests queued on a socket in batches and empties the queue
+///
+/// Checks whose request could not be sent are failed immediately.
+void Healthcheck_ping::flush_queue(struct PingSocket *ping_socket) {
+  int socket_fd = ping_socket->fd;
+  vector<Healthcheck_ping *> &queue = ping_socket->send_queue;
+  size_t count = queue.size();
+  if (count == 0)
+    return;
+
+  // Those vectors only grow, so after the first few passes no memory is
+  // allocated here.
+  if (send_msgs.size() < count) {
+    send_msgs.resize(count);
+    send_iovecs.resize(count);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    Healthcheck_ping *hc = queue[i];
+    send_iovecs[i].iov_base = &hc->echo_request;
+    send_iovecs[i].iov_len = (hc->address_family == AF_INET)
+                                 ? sizeof(struct icmp4_echo)
+                                 : sizeof(struct icmp6_echo);
+    memset(&send_msgs[i], 0, sizeof(struct mmsghdr));
+    send_msgs[i].msg_hdr.msg_name = &hc->address;
+    send_msgs[i].msg_hdr.msg_namelen = hc->address_len;
+    send_msgs[i].msg_hdr.msg_iov = &send_iovecs[i];
+    send_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  size_t offset = 0;
+  while (offset < count) {
+    int sent;
+#ifdef HAVE_MMSG
+    sent = sendmmsg(socket_fd, &send_msgs[offset],
+                    min(count - offset, (size_t)PING_BATCH_SIZE), 0);
+#else
+    sent = sendmsg(socket_fd, &send_msgs[offset].msg_hdr, 0) < 0 ? -1 : 1;
+#endif
+    if (sent <= 0) {
+      // Only the first message of the batch has failed, fail its check and
+      // go on with the rest of the batch.
+      queue[offset]->end_check(
+          HealthcheckResult::HC_FAIL,
+          fmt::sprintf("sendmmsg() error: %s", strerror(errno)));
+      offset++;
+    } else {
+      offset += sent;
+    }
+  }
 
-  // Call parent method.
-  Healthcheck::end_check(result, message);
+  queue.clear();
 }
@@ -16,10 +16,39 @@
 #include <netinet/ip_icmp.h>
 #include <nlohmann/json.hpp>
 #include <sstream>
+#include <sys/socket.h>
 #include <vector>
 
 #include "healthcheck.h"
 
+// Linux and FreeBSD can send and receive multiple datagrams in one syscall.
+// Elsewhere the batches are processed one message at a time.
+#if defined(__linux__) || defined(__FreeBSD__)
+#define HAVE_MMSG
+#else
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif
+
+// Maximum number of packets handled by a single sendmmsg() or recvmmsg().
+#define PING_BATCH_SIZE 1024
+
+// Space for each received packet. Echo Replies to our requests and ICMP
+// errors quoting them are much smaller than that.
+#define PING_RECV_SIZE 512
+
+// Number of ICMP Sequence Numbers, thus checks, for one ICMP id.
+#define PING_SLOT_SIZE 65536
+
+// Receive buffer of ping sockets.
+#define PING_RCVBUF_SIZE (16 * 1024 * 1024)
+
+// Space for ancillary data of each received packet: the kernel timestamp or
+// an extended error with its offender address.
+#define PING_CONTROL_SIZE 128
+
 #define ICMP_FILL_DATA                                                         \
   "Dave, this conversation can serve no purpose anymore. Goodbye."
 
@@ -49,6 +78,28 @@ union icmp_echo {
   struct icmp6_echo icmp6;
 };
 
+// Checks sharing one ICMP id. Each check owns one sequence number for all
+// its probes, which is an index in the checks vector.
+struct PingIdSlot {
+  uint16_t id; // Only meaningful for raw sockets.
+  vector<class Healthcheck_ping *> checks;
+};
+
+// A socket used for sending Echo Requests and receiving replies. There is
+// one raw socket per address family, holding as many id slots as needed.
+// In datagram mode there are possibly many datagram sockets per address
+// family, the kernel chooses their id so each of them has a single slot.
+struct PingSocket {
+  int fd;
+  int family;
+  struct event *ev;
+  vector<struct PingIdSlot *> slots;
+  // Echo Requests built during one scheduler pass, sent by flush().
+  vector<class Healthcheck_ping *> send_queue;
+};
+
+u_short in_cksum(u_short *addr, int len);
+
 class Healthcheck_ping : public Healthcheck {
 
   // Methods
@@ -56,30 +107,55 @@ public:
   Healthcheck_ping(const nlohmann::json &config, class LbNode *_parent_lbnode,
                    string *ip_address);
   int schedule_healthcheck(struct timespec *now);
-  static int initialize();
+  static int initialize(int dgram_shards);
   static void destroy();
+  static void flush();
   void finalize();
 
 protected:
-  void end_check(HealthcheckResult result, string message);
   static void callback(evutil_socket_t fd, short what, void *arg);
+  static bool open_sockets(int family, int type, int count);
+  static int setup_socket(struct PingSocket *ping_socket);
+  void init_probe();
+  void assign_slot();
+  static void flush_queue(struct PingSocket *ping_socket);
+  static void handle_packet(struct PingSocket *ping_socket,
+                            unsigned char *raw_packet, ssize_t received_bytes,
+                            struct timespec *now);
+  static void handle_error_queue(struct PingSocket *ping_socket);
+  static Healthcheck_ping *match_request(struct PingSocket *ping_socket,
+                                         union icmp_echo *echo,
+                                         ssize_t echo_len);
+  static string icmp_error_message(bool is_ipv4, int type, int code);
+  bool is_my_address(const void *ip_address);
 
   // Members
 private:
   // Some variables and functions are static for all ping healthchecks.
-  static int socket4_fd;
-  static int socket6_fd;
-  static struct event *ev4;
-  static struct event *ev6;
+  static vector<struct PingSocket *> sockets4;
+  static vector<struct PingSocket *> sockets6;
+  static unsigned int next_socket;
+  static bool dgram_mode;
   static uint16_t ping_id;
-  static uint16_t ping_global_seq;
+
+  // As ICMP sockets are shared, we need some trick to map Echo Response to
+  // the object which sent the Echo Request. Each object gets its own socket,
+  // ICMP id and Sequence Number once, in constructor. The Echo Response is
+  // mapped back by id and Sequence Number and then verified against the
+  // timestamp of the last Echo Request sent by the object.
+  struct PingSocket *ping_socket;
+  uint16_t ping_my_id;
   uint16_t ping_my_seq;
+  union icmp_echo echo_request; // Kept until the reply is received.
+
+  static vector<struct mmsghdr> send_msgs;
+  static vector<struct iovec> send_iovecs;
 
-  // As ICMP socket is a raw one, we need some trick to map Echo Response to the
-  // object which sent the Echo Request. So let us map the ICMP Sequence
-  // Number to the Object. The object itself also knows the last Sequence
-  // Number it sent.
-  static Healthcheck_ping **seq_map;
+  // Preallocated buffers for recvmmsg().
+  static unsigned char (*recv_packets)[PING_RECV_SIZE];
+  static unsigned char (*recv_controls)[PING_CONTROL_SIZE];
+  static struct mmsghdr *recv_msgs;
+  static struct iovec *recv_iovecs;
 };
 
 #endif
@@ -8,14 +8,18 @@
 
 #define FMT_HEADER_ONLY
 
+#include <arpa/inet.h>
 #include <cassert>
 #include <errno.h>
 #include <event2/event.h>
+#include <event2/util.h>
 #include <fmt/format.h>
 #include <fmt/printf.h>
 #include <iostream>
 #include <nlohmann/json.hpp>
 #include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
 #include <vector>
 
 #if defined(__FreeBSD__) || defined(__APPLE__)
@@ -53,9 +57,39 @@ Healthcheck_postgres::Healthcheck_postgres(const nlohmann::json &config,
   this->dbname = safe_get<string>(config, "hc_dbname", "");
   this->user = safe_get<string>(config, "hc_user", "");
   this->query = safe_get<string>(config, "hc_query", "");
+  this->persistent = safe_get<bool>(config, "hc_persistent", false);
+  string mode = safe_get<string>(config, "hc_mode", "query");
+  this->ping_mode = (mode == "ping");
+  if (mode != "ping" && mode != "query")
+    log(MessageType::MSG_CRIT,
+        "Unknown hc_mode " + mode + ", falling back to query!");
+  this->set_address_port(this->port);
+
+  if (this->ping_mode)
+    this->log_prefix =
+        fmt::sprintf("mode: ping port: %d host: %s", this->port, this->host);
+  else
+    this->log_prefix = fmt::sprintf("query: '%s' port: %d host: %s",
+                                    this->query, this->port, this->host);
+
+  this->conn = NULL;
+  this->conn_reused = false;
+  this->ping_socket = -1;
+
+  // The timeout event never changes, the I/O one is assigned again for each
+  // step as the socket is different for each connection.
+  memset(&this->io_event, 0, sizeof(this->io_event));
+  event_assign(&this->timeout_event, eventBase, -1, 0,
+               &Healthcheck_postgres::handle_timeout_event, this);
+}
 
-  this->log_prefix = fmt::sprintf("query: '%s' port: %d host: %s", this->query,
-                                  this->port, this->host);
+/// Probes can be shared only by checks connecting the same way and sending
+/// the same query.
+string Healthcheck_postgres::get_probe_key() {
+  return Healthcheck::get_probe_key() +
+         fmt::sprintf(" port: %d dbname: %s user: %s persistent: %d", port,
+                      dbname, user, persistent) +
+         (ping_mode ? " mode: ping" : " query: " + query);
 }
 
 /// The entrypoint of the class
@@ -74,12 +108,17 @@ int Healthcheck_postgres::schedule_healthcheck(struct timespec *now) {
 
   this->event_counter = 0;
   this->event_flag = 0;
-  this->io_event = NULL;
-  this->timeout_event = NULL;
   this->register_timeout_event();
 
-  // The first step
-  this->start_conn();
+  // The first step, the connection might be kept from the previous run.
+  if (this->ping_mode) {
+    this->start_ping();
+  } else if (this->conn != NULL) {
+    this->conn_reused = true;
+    this->drain_results();
+  } else {
+    this->start_conn();
+  }
 
   return true;
 }
@@ -111,12 +150,14 @@ void Healthcheck_postgres::start_conn() {
                           "SQL_ASCII",
                           "testtool",
                           NULL};
+  this->conn_reused = false;
   this->conn = PQconnectStartParams(keys, values, 0);
 
   // If it is NULL, the memory allocation must have been failed.
   if (this->conn == NULL)
     return this->end_check(HealthcheckResult::HC_PANIC,
                            "cannot start db connection");
+  this->add_probe_socket();
 
   // The connection can fail right away.
   if (PQstatus(this->conn) == CONNECTION_BAD)
@@ -175,6 +216,36 @@ void Healthcheck_postgres::poll_conn() {
   }
 }
 
+/// Read what is left from the previous run on a kept connection and continue
+///
+/// PQsendQuery() refuses to send a new query until PQgetResult() has returned
+/// NULL for the previous one.  This is usually already possible, as
+/// the server sends the end of the query together with its result.
+/// Reading also tells us if the server has closed the connection since.
+void Healthcheck_postgres::drain_results() {
+  PGresult *old_result;
+
+  if (PQstatus(this->conn) != CONNECTION_OK)
+    return this->end_check(HealthcheckResult::HC_FAIL,
+                           "kept db connection is bad");
+
+  if (!PQconsumeInput(this->conn))
+    return this->end_check(HealthcheckResult::HC_FAIL, "cannot consume input");
+
+  while (!PQisBusy(this->conn)) {
+    old_result = PQgetResult(this->conn);
+
+    // The next step
+    if (old_result == NULL)
+      return this->send_query();
+
+    PQclear(old_result);
+  }
+
+  // We have to wait for the rest.
+  this->register_io_event(EV_READ, &Healthcheck_postgres::drain_results);
+}
+
 // Send the query to the database and continue
 void Healthcheck_postgres::send_query() {
   assert(PQstatus(this->conn) == CONNECTION_OK);
@@ -225,8 +296,10 @@ void Healthcheck_postgres::flush_query() {
     return this->register_io_event(EV_READ | EV_WRITE,
                                    &Healthcheck_postgres::flush_query);
 
-  // The next step
-  this->register_io_event(EV_READ, &Healthcheck_postgres::handle_query);
+  // The next step.  The result might have already been read by
+  // PQconsumeInput() above, so the socket would never become read-ready
+  // again.  Try to handle it right away, it waits for the socket if needed.
+  this->handle_query();
 }
 
 /// Handle the query and continue
@@ -237,7 +310,6 @@ void Healthcheck_postgres::flush_query() {
 void Healthcheck_postgres::handle_query() {
   char *val;
 
-  assert(this->event_flag == EV_READ);
   assert(PQstatus(this->conn) == CONNECTION_OK);
   assert(PQisnonblocking(this->conn));
 
@@ -247,9 +319,11 @@ void Healthcheck_postgres::handle_query() {
     return this->end_check(HealthcheckResult::HC_FAIL,
                            "cannot consume db result");
 
-  // As the input is consumed, the connections must not be busy.
-  // If it would have been busy, PQgetResult() would block.
-  assert(!PQisBusy(this->conn));
+  // If the connection is still busy, the result has not been completely
+  // received and PQgetResult() would block.
+  if (PQisBusy(this->conn))
+    return this->register_io_event(EV_READ,
+                                   &Healthcheck_postgres::handle_query);
 
   this->result = PQgetResult(this->conn);
 
@@ -278,8 +352,204 @@ void Healthcheck_postgres::handle_query() {
   return this->end_check(HealthcheckResult::HC_PASS, "db result true");
 }
 
+/// Start a connection for the ping mode and continue
+///
+/// The ping mode works like PQping(): it only tells if the server accepts
+/// connections.  We don't use libpq for it, as libpq would go on with
+/// authentication and the startup of the backend.  Instead we send
+/// the startup packet ourselves and look only at the first message of
+/// the server, never sending any credentials.  With trust authentication
+/// the backend starts up anyway, we just close the connection.  The steps
+/// are driven by the same I/O events as the libpq connection.
+void Healthcheck_postgres::start_ping() {
+  this->ping_socket = this->open_probe_socket();
+  if (this->ping_socket == -1)
+    return this->end_check(HealthcheckResult::HC_PANIC,
+                           fmt::sprintf("socket() error: %s", strerror(errno)));
+
+  if (connect(this->ping_socket, (struct sockaddr *)&this->address,
+              this->address_len) == -1 &&
+      errno != EINPROGRESS)
+    return this->end_check(
+        HealthcheckResult::HC_FAIL,
+        fmt::sprintf("no response: %s", strerror(errno)));
+
+  // The startup packet of protocol version 3.0.  It is sent only once
+  // the connection is established.
+  string params;
+  params += string("user") + '\0' +
+            (this->user.empty() ? "testtool" : this->user) + '\0';
+  if (!this->dbname.empty())
+    params += string("database") + '\0' + this->dbname + '\0';
+  params += string("application_name") + '\0' + "testtool" + '\0';
+  params += '\0';
+
+  uint32_t length = htonl(8 + params.size());
+  uint32_t version = htonl(3 << 16);
+  this->ping_buffer.assign((char *)&length, sizeof(length));
+  this->ping_buffer.append((char *)&version, sizeof(version));
+  this->ping_buffer += params;
+  this->ping_offset = 0;
+
+  // The next step
+  this->register_io_event(EV_WRITE, &Healthcheck_postgres::send_startup);
+}
+
+/// Recursively send the startup packet and continue
+void Healthcheck_postgres::send_startup() {
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+
+  // The first write readiness tells that connect() has finished.
+  if (this->ping_offset == 0 &&
+      getsockopt(this->ping_socket, SOL_SOCKET, SO_ERROR, &error,
+                 &error_len) == 0 &&
+      error != 0)
+    return this->end_check(HealthcheckResult::HC_FAIL,
+                           fmt::sprintf("no response: %s", strerror(error)));
+
+  ssize_t sent = send(this->ping_socket,
+                      this->ping_buffer.data() + this->ping_offset,
+                      this->ping_buffer.size() - this->ping_offset,
+                      MSG_NOSIGNAL);
+  if (sent == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return this->register_io_event(EV_WRITE,
+                                     &Healthcheck_postgres::send_startup);
+    return this->end_check(HealthcheckResult::HC_FAIL,
+                           fmt::sprintf("no response: %s", strerror(errno)));
+  }
+
+  this->ping_offset += sent;
+  if (this->ping_offset < this->ping_buffer.size())
+    return this->register_io_event(EV_WRITE,
+                                   &Healthcheck_postgres::send_startup);
+
+  // The next step
+  this->ping_buffer.clear();
+  this->register_io_event(EV_READ,
+                          &Healthcheck_postgres::read_startup_response);
+}
+
+/// Recursively read the first message of the server and continue
+///
+/// It is either an authentication request or an error.  We need only
+/// the type of the former, but the whole latter.
+void Healthcheck_postgres::read_startup_response() {
+  char buffer[512];
+
+  ssize_t received = recv(this->ping_socket, buffer, sizeof(buffer), 0);
+  if (received == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return this->register_io_event(
+          EV_READ, &Healthcheck_postgres::read_startup_response);
+    return this->end_check(HealthcheckResult::HC_FAIL,
+                           fmt::sprintf("no response: %s", strerror(errno)));
+  }
+  if (received == 0)
+    return this->end_check(HealthcheckResult::HC_FAIL,
+                           "no response: connection closed");
+
+  this->ping_buffer.append(buffer, received);
+
+  // Wait for the message header.
+  if (this->ping_buffer.size() < 5)
+    return this->register_io_event(
+        EV_READ, &Healthcheck_postgres::read_startup_response);
+
+  // Wait for the rest of an error message, the server sends it at once.
+  // Error messages are not long, do not wait for anything unreasonable.
+  uint32_t length;
+  memcpy(&length, this->ping_buffer.data() + 1, sizeof(length));
+  length = ntohl(length);
+  if (this->ping_buffer[0] == 'E' && length < 4096 &&
+      this->ping_buffer.size() < length + 1)
+    return this->register_io_event(
+        EV_READ, &Healthcheck_postgres::read_startup_response);
+
+  // The next step
+  this->handle_startup_response();
+}
+
+/// Interpret the first message of the server
+///
+/// This is the final step of the ping mode.  Like PQping(), we consider
+/// any response but the one telling that the database system is starting
+/// up or shutting down as accepting connections.  Authentication failure
+/// is such a response, because the server had to accept the connection
+/// to tell it.
+void Healthcheck_postgres::handle_startup_response() {
+  switch (this->ping_buffer[0]) {
+  case 'R':
+    return this->end_check(HealthcheckResult::HC_PASS,
+                           "server accepting connections");
+
+  case 'E': {
+    // The error message consists of fields, each is a type byte and
+    // a string.
+    string code, message;
+    size_t pos = 5;
+    while (pos < this->ping_buffer.size() && this->ping_buffer[pos] != '\0') {
+      char field = this->ping_buffer[pos++];
+      size_t end = this->ping_buffer.find('\0', pos);
+      if (end == string::npos)
+        break;
+      if (field == 'C')
+        code = this->ping_buffer.substr(pos, end - pos);
+      else if (field == 'M')
+        message = this->ping_buffer.substr(pos, end - pos);
+      pos = end + 1;
+    }
+
+    // ERRCODE_CANNOT_CONNECT_NOW
+    if (code == "57P03")
+      return this->end_check(
+          HealthcheckResult::HC_FAIL,
+          fmt::sprintf("server rejecting connections: %s", message));
+
+    return this->end_check(
+        HealthcheckResult::HC_PASS,
+        fmt::sprintf("server accepting connections: %s", message));
+  }
+  }
+
+  return this->end_check(
+      HealthcheckResult::HC_FAIL,
+      fmt::sprintf("unexpected response '%c'", this->ping_buffer[0]));
+}
+
+/// Get the socket of the connection in use
+int Healthcheck_postgres::get_socket() {
+  if (this->ping_mode)
+    return this->ping_socket;
+  return PQsocket(this->conn);
+}
+
 /// Override end_check() method to clean up things
+///
+/// A failure on a kept connection is not trusted, the server might have
+/// closed it in the meantime.  The check is retried with a fresh connection
+/// in the same run, unless it has already timed out.
 void Healthcheck_postgres::end_check(HealthcheckResult result, string message) {
+  if (result != HealthcheckResult::HC_PASS && this->conn_reused &&
+      this->event_flag != EV_TIMEOUT) {
+    if (verbose >= 2)
+      log(MessageType::MSG_DEBUG, this,
+          fmt::sprintf("kept db connection failed: %s, reconnecting", message));
+
+    if (this->result != NULL) {
+      PQclear(this->result);
+      this->result = NULL;
+    }
+    if (event_initialized(&this->io_event))
+      event_del(&this->io_event);
+    this->remove_probe_socket();
+    PQfinish(this->conn);
+    this->conn = NULL;
+
+    return this->start_conn();
+  }
+
   if (result != HealthcheckResult::HC_PASS && this->conn != NULL) {
     char *error = PQerrorMessage(this->conn);
 
@@ -296,19 +566,21 @@ void Healthcheck_postgres::end_check(HealthcheckResult result, string message) {
     this->result = NULL;
   }
 
-  if (this->io_event != NULL) {
-    event_del(this->io_event);
-    event_free(this->io_event);
-    this->io_event = NULL;
-  }
+  if (event_initialized(&this->io_event))
+    event_del(&this->io_event);
 
-  if (this->timeout_event != NULL) {
-    event_del(this->timeout_event);
-    event_free(this->timeout_event);
-    this->timeout_event = NULL;
+  event_del(&this->timeout_event);
+
+  if (this->ping_socket != -1) {
+    this->release_probe_socket(this->ping_socket);
+    close(this->ping_socket);
+    this->ping_socket = -1;
   }
 
-  if (this->conn != NULL) {
+  // Only a connection which has just been proven to work is kept.
+  if (this->conn != NULL &&
+      !(this->persistent && result == HealthcheckResult::HC_PASS)) {
+    this->remove_probe_socket();
     PQfinish(this->conn);
     this->conn = NULL;
   }
@@ -316,6 +588,9 @@ void Healthcheck_postgres::end_check(HealthcheckResult result, string message) {
   Healthcheck::end_check(result, message);
 }
 
+/// Each run uses its own connection, or keeps it open for the next one.
+bool Healthcheck_postgres::opens_probe_socket() { return true; }
+
 /// Helper method to register methods to libevent
 ///
 /// This function should not fail, but we cannot just continue if it does.
@@ -335,32 +610,26 @@ void Healthcheck_postgres::register_io_event(
     return this->end_check(HealthcheckResult::HC_PANIC, "too many events");
 
   this->callback_method = method;
-  this->io_event = event_new(eventBase, PQsocket(this->conn), flag,
-                             &Healthcheck_postgres::handle_io_event, this);
 
-  if (this->io_event == NULL)
-    return this->end_check(HealthcheckResult::HC_PANIC, "cannot create event");
+  // The event is not pending at this point, so it can be assigned again.
+  if (event_assign(&this->io_event, eventBase, this->get_socket(), flag,
+                   &Healthcheck_postgres::handle_io_event, this) != 0)
+    return this->end_check(HealthcheckResult::HC_PANIC, "cannot assign event");
 
   // Note that we are registering it without a timeout.
-  if (event_add(this->io_event, 0) != 0)
+  if (event_add(&this->io_event, 0) != 0)
     return this->end_check(HealthcheckResult::HC_PANIC, "cannot add event");
 }
 
 /// Helper method to register the timeout event to libevent
 ///
-/// XXX This is a copy of the function above.  It should be shared by all
-/// health checks.
+/// XXX This should be shared by all health checks.
 void Healthcheck_postgres::register_timeout_event() {
 
-  // We don't need t file descriptor or an event flag, because
-  // it will only be used for timeout.
-  this->timeout_event = event_new(
-      eventBase, -1, 0, &Healthcheck_postgres::handle_timeout_event, this);
-
-  if (this->timeout_event == NULL)
-    return this->end_check(HealthcheckResult::HC_PANIC, "cannot create event");
-
-  if (event_add(this->timeout_event, &this->timeout) != 0)
+  // The event was assigned in the constructor, without a file descriptor
+  // or an event flag, because it is only used for timeout.
+  if (event_add(&this->timeout_event, this->get_common_timeout(eventBase)) !=
+      0)
     return this->end_check(HealthcheckResult::HC_PANIC, "cannot add event");
 }
 
@@ -374,7 +643,7 @@ void Healthcheck_postgres::handle_io_event(int fd, short flag, void *arg) {
 
   // We don't need the file descriptor, but as it is passed by
   // libevent, lets check that it is the correct one.
-  assert(PQsocket(hc->conn) == fd);
+  assert(hc->get_socket() == fd);
 
   // We can only pass a single event flag to the callback method.
   // There are other codes libevent could return, but we are not
@@ -385,9 +654,8 @@ void Healthcheck_postgres::handle_io_event(int fd, short flag, void *arg) {
   // terribly wrong.
   assert(hc->is_running);
 
-  // We are going to reuse this event.
-  event_free(hc->io_event);
-  hc->io_event = NULL;
+  // The event is not persistent, so it is not pending anymore and
+  // the next step can assign it again.
 
   // Call the actual callback method
   hc->event_flag = flag;
@@ -35,10 +35,18 @@ public:
 protected:
   void start_conn();
   void poll_conn();
+  void drain_results();
+  void start_ping();
+  void send_startup();
+  void read_startup_response();
+  void handle_startup_response();
+  int get_socket();
   void send_query();
   void flush_query();
   void handle_query();
   void end_check(HealthcheckResult result, string message);
+  bool opens_probe_socket();
+  string get_probe_key();
   void register_io_event(short flag, void (Healthcheck_postgres::*method)());
   void register_timeout_event();
   static void handle_io_event(int fd, short flag, void *arg);
@@ -51,11 +59,18 @@ protected:
   string dbname;
   string user;
   string query;
+  bool persistent;  // Keep the connection open between runs.
+  bool conn_reused; // The connection was kept from the previous run.
+  bool ping_mode;   // Only check if the server accepts connections.
   PGconn *conn;
+  int ping_socket;      // Our own connection in ping mode, without libpq.
+  string ping_buffer;   // Startup packet to send, then the server response.
+  size_t ping_offset;
   PostgresPollingStatusType *poll_status;
   PGresult *result = NULL;
-  struct event *io_event;
-  struct event *timeout_event;
+  // Events are embedded in the object and reused on each run.
+  struct event io_event;
+  struct event timeout_event;
   short event_flag;
   int event_counter;
   void (Healthcheck_postgres::*callback_method)();
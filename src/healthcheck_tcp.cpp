@@ -13,15 +13,22 @@
 #include <event2/util.h>
 #include <fmt/format.h>
 #include <fmt/printf.h>
+#include <fstream>
 #include <iostream>
 #include <nlohmann/json.hpp>
 #include <sstream>
+#include <netinet/ip.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <vector>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 
 #include "config.h"
 #include "healthcheck.h"
+#include "healthcheck_ping.h"
 #include "healthcheck_tcp.h"
 #include "lb_node.h"
 #include "lb_pool.h"
@@ -32,15 +39,347 @@ using namespace std;
 extern struct event_base *eventBase;
 extern int verbose;
 
+// In the .h file there are only declarations of static variables, here we have
+// definitions.
+int Healthcheck_tcp::syn_socket4 = -1;
+int Healthcheck_tcp::syn_socket6 = -1;
+struct event *Healthcheck_tcp::syn_ev4 = NULL;
+struct event *Healthcheck_tcp::syn_ev6 = NULL;
+std::mt19937 Healthcheck_tcp::random_generator;
+vector<vector<Healthcheck_tcp *>> Healthcheck_tcp::syn_ports;
+unsigned int Healthcheck_tcp::next_syn_port = 0;
+vector<Healthcheck_tcp *> Healthcheck_tcp::syn_queue4;
+vector<Healthcheck_tcp *> Healthcheck_tcp::syn_queue6;
+vector<struct mmsghdr> Healthcheck_tcp::send_msgs;
+vector<struct iovec> Healthcheck_tcp::send_iovecs;
+unsigned char (*Healthcheck_tcp::recv_packets)[SYN_RECV_SIZE];
+struct sockaddr_storage *Healthcheck_tcp::recv_sources;
+struct mmsghdr *Healthcheck_tcp::recv_msgs;
+struct iovec *Healthcheck_tcp::recv_iovecs;
+
 /// Constructor for TCP healthcheck.
 Healthcheck_tcp::Healthcheck_tcp(const nlohmann::json &config,
                                  class LbNode *_parent_lbnode,
                                  string *ip_address)
     : Healthcheck(config, _parent_lbnode, ip_address) {
   this->port = safe_get<int>(config, "hc_port", 80);
+  this->set_address_port(port);
   type = "tcp";
+  this->bev = NULL;
+  this->uring_socket = -1;
+  this->uring_request.callback = Healthcheck_tcp::uring_connect_callback;
+  this->uring_request.arg = this;
+
+  // SYN probes need raw sockets. Without them the check silently falls back
+  // to connect(), initialize() has already told about it.
+  this->syn_mode = false;
+  int syn_socket = (address_family == AF_INET) ? syn_socket4 : syn_socket6;
+  string mode = safe_get<string>(config, "hc_mode", "connect");
+  if (mode != "syn" && mode != "connect")
+    log(MessageType::MSG_CRIT,
+        "Unknown hc_mode " + mode + ", falling back to connect!");
+  if (mode == "syn" && syn_socket != -1 && find_source_address())
+    this->syn_mode = true;
+
+  if (this->syn_mode) {
+    this->log_prefix = fmt::sprintf("mode: syn port: %d", this->port);
+    event_assign(&this->timeout_event, eventBase, -1, 0,
+                 Healthcheck_tcp::timeout_callback, this);
+  } else {
+    this->log_prefix = fmt::sprintf("port: %d", this->port);
+  }
+}
+
+/// Opens a raw socket for SYN probes of given address family
+///
+/// Returns -1 if it is not possible, which is not an error, checks use
+/// connect() then.
+int Healthcheck_tcp::open_syn_socket(int family) {
+#ifdef __linux__
+  int syn_socket = socket(family, SOCK_RAW, IPPROTO_TCP);
+  if (syn_socket == -1) {
+    log(MessageType::MSG_INFO,
+        fmt::sprintf("SYN probes not available for %s: %s, using connect()",
+                     family == AF_INET ? "IPv4" : "IPv6", strerror(errno)));
+    return -1;
+  }
+
+  // Replies to a whole batch of probes arrive at once.
+  int newbuf = SYN_RCVBUF_SIZE;
+  if (setsockopt(syn_socket, SOL_SOCKET, SO_RCVBUFFORCE, &newbuf,
+                 sizeof(int)) < 0)
+    setsockopt(syn_socket, SOL_SOCKET, SO_RCVBUF, &newbuf, sizeof(int));
+
+  // A raw TCP socket gets a copy of every TCP segment received by the
+  // system. Let the kernel pass only those sent to our source ports and
+  // only their headers. IPv4 segments come with the IP header, IPv6 ones
+  // without. Non-first IPv4 fragments carry no TCP header, they are dropped.
+  // The IPv6 filter expects the TCP header right after the IPv6 one, so only
+  // segments without extension headers are matched.
+  struct sock_filter filter4[] = {
+      BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+      BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+      BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+      BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+      BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, SYN_PORT_FIRST, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, SYN_RECV_SIZE),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_filter filter6[] = {
+      BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2),
+      BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, SYN_PORT_FIRST, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, SYN_RECV_SIZE),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog program;
+  if (family == AF_INET) {
+    program.len = sizeof(filter4) / sizeof(filter4[0]);
+    program.filter = filter4;
+  } else {
+    program.len = sizeof(filter6) / sizeof(filter6[0]);
+    program.filter = filter6;
+  }
+  if (setsockopt(syn_socket, SOL_SOCKET, SO_ATTACH_FILTER, &program,
+                 sizeof(program)) < 0) {
+    log(MessageType::MSG_CRIT,
+        fmt::sprintf("SYN probe sockopt filter error: %s", strerror(errno)));
+    close(syn_socket);
+    return -1;
+  }
+
+  return syn_socket;
+#else
+  // Elsewhere raw sockets don't receive TCP segments.
+  (void)(family);
+  return -1;
+#endif
+}
+
+/// Checks that the kernel doesn't use source ports of SYN probes
+///
+/// Its own connections from these ports would get our replies and our
+/// probes would get theirs.
+bool Healthcheck_tcp::check_local_port_range() {
+#ifdef __linux__
+  ifstream port_range("/proc/sys/net/ipv4/ip_local_port_range");
+  int first, last;
+  if (port_range >> first >> last && last >= SYN_PORT_FIRST &&
+      first <= SYN_PORT_LAST) {
+    log(MessageType::MSG_CRIT,
+        fmt::sprintf("SYN probes not available: ip_local_port_range %d-%d "
+                     "overlaps their source ports %d-%d, using connect()",
+                     first, last, SYN_PORT_FIRST, SYN_PORT_LAST));
+    return false;
+  }
+#endif
+  return true;
+}
+
+/// A common initializator for all healthchecks of tcp type.
+///
+/// Should be called once at the startup of testtool. Opens raw sockets for
+/// SYN probes if the system permits it.
+int Healthcheck_tcp::initialize() {
+  random_generator.seed(std::random_device()());
+
+  if (!check_local_port_range())
+    return true;
+
+  syn_socket4 = open_syn_socket(AF_INET);
+  syn_socket6 = open_syn_socket(AF_INET6);
+  if (syn_socket4 == -1 && syn_socket6 == -1)
+    return true;
+
+  // Allocate buffers for receiving batches of segments.
+  recv_packets = (unsigned char(*)[SYN_RECV_SIZE])malloc(SYN_BATCH_SIZE *
+                                                         SYN_RECV_SIZE);
+  recv_sources = (struct sockaddr_storage *)calloc(
+      SYN_BATCH_SIZE, sizeof(struct sockaddr_storage));
+  recv_msgs = (struct mmsghdr *)calloc(SYN_BATCH_SIZE, sizeof(struct mmsghdr));
+  recv_iovecs = (struct iovec *)calloc(SYN_BATCH_SIZE, sizeof(struct iovec));
+  for (int i = 0; i < SYN_BATCH_SIZE; i++) {
+    recv_iovecs[i].iov_base = recv_packets[i];
+    recv_iovecs[i].iov_len = SYN_RECV_SIZE;
+    recv_msgs[i].msg_hdr.msg_iov = &recv_iovecs[i];
+    recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    recv_msgs[i].msg_hdr.msg_name = &recv_sources[i];
+    recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+  }
+
+  syn_ports.resize(SYN_PORT_LAST - SYN_PORT_FIRST + 1);
+
+  // Create events and make them pending.
+  if (syn_socket4 != -1) {
+    syn_ev4 = event_new(eventBase, syn_socket4, EV_READ | EV_PERSIST,
+                        Healthcheck_tcp::syn_callback, NULL);
+    event_add(syn_ev4, NULL);
+  }
+  if (syn_socket6 != -1) {
+    syn_ev6 = event_new(eventBase, syn_socket6, EV_READ | EV_PERSIST,
+                        Healthcheck_tcp::syn_callback, NULL);
+    event_add(syn_ev6, NULL);
+  }
+
+  return true;
+}
 
-  this->log_prefix = fmt::sprintf("port: %d", this->port);
+/// A common "destructor" for all healthchecks of tcp type.
+///
+/// Should be called when testtool terminates.
+void Healthcheck_tcp::destroy() {
+  for (auto *syn_ev : {&syn_ev4, &syn_ev6}) {
+    if (*syn_ev != NULL) {
+      event_del(*syn_ev);
+      event_free(*syn_ev);
+      *syn_ev = NULL;
+    }
+  }
+  for (auto *syn_socket : {&syn_socket4, &syn_socket6}) {
+    if (*syn_socket != -1) {
+      close(*syn_socket);
+      *syn_socket = -1;
+    }
+  }
+
+  free(recv_packets);
+  free(recv_sources);
+  free(recv_msgs);
+  free(recv_iovecs);
+}
+
+/// Finds the local address the kernel would use to reach the tested node
+///
+/// It is needed for the checksum of SYN segments. A connected UDP socket
+/// makes the kernel look up the route without sending anything.
+bool Healthcheck_tcp::lookup_source_address(struct sockaddr_storage *source) {
+  int udp_socket = socket(address_family, SOCK_DGRAM, 0);
+  if (udp_socket == -1)
+    return false;
+
+  memset(source, 0, sizeof(*source));
+  socklen_t source_len = sizeof(*source);
+  bool found =
+      connect(udp_socket, (struct sockaddr *)&address, address_len) == 0 &&
+      getsockname(udp_socket, (struct sockaddr *)source, &source_len) == 0;
+  int error = errno;
+  close(udp_socket);
+  errno = error;
+
+  // Only the address is used, drop the port chosen for the UDP socket.
+  if (found && address_family == AF_INET)
+    ((struct sockaddr_in *)source)->sin_port = 0;
+  else if (found)
+    ((struct sockaddr_in6 *)source)->sin6_port = 0;
+
+  return found;
+}
+
+/// Prepares addresses of SYN probes, returns false if they are not possible
+bool Healthcheck_tcp::find_source_address() {
+  if (!lookup_source_address(&syn_source)) {
+    log(MessageType::MSG_INFO, this,
+        fmt::sprintf("no route for SYN probes: %s, using connect()",
+                     strerror(errno)));
+    return false;
+  }
+
+  // Raw IPv6 sockets take the port as protocol number, it must be unset.
+  memcpy(&syn_destination, &address, sizeof(syn_destination));
+  if (address_family == AF_INET)
+    ((struct sockaddr_in *)&syn_destination)->sin_port = 0;
+  else
+    ((struct sockaddr_in6 *)&syn_destination)->sin6_port = 0;
+
+  return true;
+}
+
+/// Looks up the source address of SYN probes again
+///
+/// The route to the tested node or its source address might have changed,
+/// then our SYN segments have a wrong checksum and are dropped. The old
+/// address is kept if there is no route now, probes fail anyway then.
+void Healthcheck_tcp::update_source_address() {
+  struct sockaddr_storage source;
+  if (!lookup_source_address(&source))
+    return;
+
+  if (memcmp(&source, &syn_source, sizeof(source)) != 0) {
+    log(MessageType::MSG_INFO, this, "source address of SYN probes changed");
+    memcpy(&syn_source, &source, sizeof(source));
+  }
+}
+
+/// Probes can be shared only by checks connecting to the same port the same
+/// way.
+string Healthcheck_tcp::get_probe_key() {
+  return Healthcheck::get_probe_key() +
+         fmt::sprintf(" port: %d mode: %s", port,
+                      syn_mode ? "syn" : "connect");
+}
+
+/// Followers never send SYN segments, only checks running the probe get
+/// a source port.
+void Healthcheck_tcp::init_probe() {
+  if (!syn_mode)
+    return;
+  assign_syn_port();
+  if (!syn_mode)
+    this->log_prefix = fmt::sprintf("port: %d", this->port);
+}
+
+/// Assigns the source port used by SYN probes of this check
+///
+/// Checks are spread over all ports. Checks probing the same destination
+/// must use different ports, otherwise their replies would be confused.
+void Healthcheck_tcp::assign_syn_port() {
+  size_t count = syn_ports.size();
+
+  for (size_t i = 0; i < count; i++) {
+    unsigned int index = next_syn_port++ % count;
+    bool taken = false;
+    for (auto *hc : syn_ports[index]) {
+      if (hc->port == port && hc->is_my_address(&address))
+        taken = true;
+    }
+    if (!taken) {
+      syn_port = SYN_PORT_FIRST + index;
+      syn_ports[index].push_back(this);
+      return;
+    }
+  }
+
+  // All ports are taken for this destination.
+  syn_mode = false;
+}
+
+/// Checks if given address is the one this check probes
+bool Healthcheck_tcp::is_my_address(const struct sockaddr_storage *source) {
+  if (source->ss_family != address_family)
+    return false;
+  if (address_family == AF_INET)
+    return memcmp(&((struct sockaddr_in *)source)->sin_addr,
+                  &((struct sockaddr_in *)&address)->sin_addr,
+                  sizeof(struct in_addr)) == 0;
+  return memcmp(&((struct sockaddr_in6 *)source)->sin6_addr,
+                &((struct sockaddr_in6 *)&address)->sin6_addr,
+                sizeof(struct in6_addr)) == 0;
+}
+
+/// Describes the reason of a failed connection.
+///
+/// The kernel aborts a connection attempt as soon as it gets TCP RST or
+/// a hard ICMP error, so those fail the check before its timeout.
+static string connect_error_message(int error) {
+  switch (error) {
+  case ECONNREFUSED:
+    return "connection refused";
+  case EHOSTUNREACH:
+    return "host unreachable";
+  case ENETUNREACH:
+    return "network unreachable";
+  }
+  return fmt::sprintf("connection error: %s",
+                      evutil_socket_error_to_string(error));
 }
 
 /// Libevent callback for TCP healthcheck.
@@ -61,8 +400,9 @@ void Healthcheck_tcp::event_callback(struct bufferevent *bev, short events,
   }
 
   if (events & BEV_EVENT_ERROR) {
+    // Libevent leaves the error of the connect() in the socket error.
     result = HealthcheckResult::HC_FAIL;
-    message = "connection refused";
+    message = connect_error_message(EVUTIL_SOCKET_ERROR());
   }
 
   if (events & BEV_EVENT_TIMEOUT) {
@@ -74,51 +414,87 @@ void Healthcheck_tcp::event_callback(struct bufferevent *bev, short events,
 }
 
 int Healthcheck_tcp::schedule_healthcheck(struct timespec *now) {
-  int result;
-
   // Peform general stuff for scheduled healthcheck.
   if (Healthcheck::schedule_healthcheck(now) == false)
     return false;
 
-  bev = bufferevent_socket_new(eventBase, -1, 0 | BEV_OPT_CLOSE_ON_FREE);
+  if (syn_mode)
+    return schedule_syn();
+  if (Uring::is_enabled())
+    return schedule_uring();
+  return schedule_connect();
+}
+
+/// Queues a connection attempt to io_uring
+///
+/// It is submitted together with the others after the scheduler pass.
+int Healthcheck_tcp::schedule_uring() {
+  uring_socket = open_probe_socket();
+  if (uring_socket == -1) {
+    this->end_check(HealthcheckResult::HC_FAIL,
+                    fmt::sprintf("socket() error: %s", strerror(errno)));
+    return false;
+  }
+
+  if (!Uring::connect(&uring_request, uring_socket,
+                      (struct sockaddr *)&address, address_len,
+                      &this->timeout)) {
+    this->end_check(HealthcheckResult::HC_FAIL, "io_uring queue full");
+    return false;
+  }
+  return true;
+}
+
+/// io_uring callback for TCP healthcheck
+void Healthcheck_tcp::uring_connect_callback(int result, void *arg) {
+  Healthcheck_tcp *hc = (Healthcheck_tcp *)arg;
+
+  result = Uring::connect_result(result, hc->uring_socket);
+  if (result == 0)
+    return hc->end_check(HealthcheckResult::HC_PASS, "connection successful");
+
+  if (result == -ECANCELED)
+    return hc->end_check(
+        HealthcheckResult::HC_FAIL,
+        fmt::sprintf("timeout after %dms", hc->timeout_to_ms()));
+
+  hc->end_check(HealthcheckResult::HC_FAIL, connect_error_message(-result));
+}
+
+/// SYN probes share the raw socket, other runs use their own connection.
+bool Healthcheck_tcp::opens_probe_socket() { return !syn_mode; }
+
+/// Starts a connection with full TCP handshake
+int Healthcheck_tcp::schedule_connect() {
+  int result;
+
+  evutil_socket_t fd = open_probe_socket();
+  if (fd == -1) {
+    this->end_check(HealthcheckResult::HC_FAIL,
+                    fmt::sprintf("socket() error: %s", strerror(errno)));
+    return false;
+  }
+
+  bev = bufferevent_socket_new(eventBase, fd, 0 | BEV_OPT_CLOSE_ON_FREE);
   if (bev == NULL) {
     throw HealthcheckSchedulingException(
         fmt::sprintf("bufferevent_socket_new errno %d", errno));
   }
 
-  int pton_res;
-  if (address_family == AF_INET) {
-    struct sockaddr_in to_addr4;
-    memset(&to_addr4, 0, sizeof(to_addr4));
-    to_addr4.sin_family = AF_INET;
-    pton_res = inet_pton(AF_INET, ip_address->c_str(), &to_addr4.sin_addr);
-    to_addr4.sin_port = htons(port);
-    result = bufferevent_socket_connect(bev, (struct sockaddr *)&to_addr4,
-                                        sizeof(to_addr4));
-  } else if (address_family == AF_INET6) {
-    struct sockaddr_in6 to_addr6;
-    memset(&to_addr6, 0, sizeof(to_addr6));
-    to_addr6.sin6_family = AF_INET6;
-    pton_res = inet_pton(AF_INET6, ip_address->c_str(), &to_addr6.sin6_addr);
-    to_addr6.sin6_port = htons(port);
-    result = bufferevent_socket_connect(bev, (struct sockaddr *)&to_addr6,
-                                        sizeof(to_addr6));
-  } else {
-    throw HealthcheckSchedulingException(
-        fmt::sprintf("Wrong address family: %d", address_family));
-  }
+  result = bufferevent_socket_connect(bev, (struct sockaddr *)&address,
+                                      address_len);
 
   if (result == -1 && EVUTIL_SOCKET_ERROR() != EINPROGRESS) {
     this->end_check(
         HealthcheckResult::HC_FAIL,
-        fmt::sprintf("connect() error: %d errno: %s pton: %d", result,
-                     evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()),
-                     pton_res));
+        fmt::sprintf("connect() error: %d errno: %s", result,
+                     evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR())));
 
     return false;
   }
 
-  bufferevent_set_timeouts(bev, &this->timeout, &this->timeout);
+  const struct timeval *timeout = this->get_common_timeout(eventBase);
+  bufferevent_set_timeouts(bev, timeout, timeout);
   bufferevent_setcb(bev, NULL, NULL, &event_callback, this);
   // bufferevent_setcb(bev, &rw_callback, &rw_callback, &event_callback, this);
   bufferevent_enable(bev, 0);
@@ -127,21 +503,245 @@ int Healthcheck_tcp::schedule_healthcheck(struct timespec *now) {
   return true;
 }
 
-/// Overrides end_check() method to clean up things
-void Healthcheck_tcp::end_check(HealthcheckResult result, string message) {
+/// Prepares a SYN segment for this healthcheck
+///
+/// The segment is not sent immediately. It is queued and all segments built
+/// during one scheduler pass are sent by flush(). The tested node answers
+/// with SYN-ACK or RST. As there is no socket for the SYN-ACK, our kernel
+/// resets the connection.
+int Healthcheck_tcp::schedule_syn() {
+  // A new sequence number for each probe, so that late replies to earlier
+  // probes don't match.
+  syn_seq = random_generator();
+
+  memset(&syn_request, 0, sizeof(syn_request));
+  syn_request.tcp_header.th_sport = htons(syn_port);
+  syn_request.tcp_header.th_dport = htons(port);
+  syn_request.tcp_header.th_seq = htonl(syn_seq);
+  syn_request.tcp_header.th_off = sizeof(struct syn_segment) / 4;
+  syn_request.tcp_header.th_flags = TH_SYN;
+  syn_request.tcp_header.th_win = htons(65535);
+  // Maximum Segment Size: 1460
+  syn_request.options[0] = TCPOPT_MAXSEG;
+  syn_request.options[1] = TCPOLEN_MAXSEG;
+  syn_request.options[2] = 1460 >> 8;
+  syn_request.options[3] = 1460 & 0xff;
+
+  // The checksum covers the pseudo header made of IP addresses, protocol
+  // and length of the segment.
+  uint16_t buffer[(40 + sizeof(struct syn_segment)) / 2];
+  unsigned char *pseudo_header = (unsigned char *)buffer;
+  size_t pseudo_header_len;
+  memset(buffer, 0, sizeof(buffer));
+  if (address_family == AF_INET) {
+    memcpy(pseudo_header, &((struct sockaddr_in *)&syn_source)->sin_addr, 4);
+    memcpy(pseudo_header + 4, &((struct sockaddr_in *)&address)->sin_addr, 4);
+    pseudo_header[9] = IPPROTO_TCP;
+    pseudo_header[11] = sizeof(struct syn_segment);
+    pseudo_header_len = 12;
+  } else {
+    memcpy(pseudo_header, &((struct sockaddr_in6 *)&syn_source)->sin6_addr,
+           16);
+    memcpy(pseudo_header + 16,
+           &((struct sockaddr_in6 *)&address)->sin6_addr, 16);
+    pseudo_header[35] = sizeof(struct syn_segment);
+    pseudo_header[39] = IPPROTO_TCP;
+    pseudo_header_len = 40;
+  }
+  memcpy(pseudo_header + pseudo_header_len, &syn_request,
+         sizeof(struct syn_segment));
+  syn_request.tcp_header.th_sum = in_cksum(
+      (u_short *)buffer, pseudo_header_len + sizeof(struct syn_segment));
+
+  event_add(&this->timeout_event, this->get_common_timeout(eventBase));
+
+  if (address_family == AF_INET)
+    syn_queue4.push_back(this);
+  else
+    syn_queue6.push_back(this);
+
+  return true;
+}
 
-  if (verbose >= 2 && result != HealthcheckResult::HC_PASS &&
-      this->bev != NULL) {
-    char *error = evutil_socket_error_to_string(evutil_socket_geterror());
+/// Sends all queued SYN segments
+///
+/// Should be called after each scheduler pass.
+void Healthcheck_tcp::flush() {
+  flush_queue(AF_INET);
+  flush_queue(AF_INET6);
+}
+
+/// Sends SYN segments queued for one address family and empties the queue
+///
+/// Checks whose segment could not be sent are failed immediately.
+void Healthcheck_tcp::flush_queue(int family) {
+  int socket_fd = (family == AF_INET) ? syn_socket4 : syn_socket6;
+  vector<Healthcheck_tcp *> &queue =
+      (family == AF_INET) ? syn_queue4 : syn_queue6;
+  size_t count = queue.size();
+  if (count == 0)
+    return;
+
+  // Those vectors only grow, so after the first few passes no memory is
+  // allocated here.
+  if (send_msgs.size() < count) {
+    send_msgs.resize(count);
+    send_iovecs.resize(count);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    Healthcheck_tcp *hc = queue[i];
+    send_iovecs[i].iov_base = &hc->syn_request;
+    send_iovecs[i].iov_len = sizeof(struct syn_segment);
+    memset(&send_msgs[i], 0, sizeof(struct mmsghdr));
+    send_msgs[i].msg_hdr.msg_name = &hc->syn_destination;
+    send_msgs[i].msg_hdr.msg_namelen = hc->address_len;
+    send_msgs[i].msg_hdr.msg_iov = &send_iovecs[i];
+    send_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  size_t offset = 0;
+  while (offset < count) {
+    int sent;
+#ifdef HAVE_MMSG
+    sent = sendmmsg(socket_fd, &send_msgs[offset],
+                    min(count - offset, (size_t)SYN_BATCH_SIZE), 0);
+#else
+    sent = sendmsg(socket_fd, &send_msgs[offset].msg_hdr, 0) < 0 ? -1 : 1;
+#endif
+    if (sent <= 0) {
+      // Only the first message of the batch has failed, fail its check and
+      // go on with the rest of the batch.
+      queue[offset]->end_check(
+          HealthcheckResult::HC_FAIL,
+          fmt::sprintf("sendmmsg() error: %s", strerror(errno)));
+      offset++;
+    } else {
+      offset += sent;
+    }
+  }
 
-    if (error != NULL && strlen(error) > 0)
-      message += fmt::sprintf(", socket() error: %s", strerror(errno));
+  queue.clear();
+}
+
+/// Libevent callback for SYN probes
+///
+/// The raw socket is shared by all checks, so this callback reads all
+/// pending segments in batches and hands each one over to handle_segment()
+/// to be mapped to one of Healthcheck objects.
+void Healthcheck_tcp::syn_callback(evutil_socket_t socket_fd, short what,
+                                   void *arg) {
+  (void)(arg);
+  int received;
+
+  // Pending errors are reported by some backends as both read and write
+  // readiness.
+  if (!(what & EV_READ))
+    return;
+
+  int family = (socket_fd == syn_socket4) ? AF_INET : AF_INET6;
+
+  // Reading never waits. It goes on until there is nothing more to read.
+  while (true) {
+#ifdef HAVE_MMSG
+    received =
+        recvmmsg(socket_fd, recv_msgs, SYN_BATCH_SIZE, MSG_DONTWAIT, NULL);
+#else
+    ssize_t received_bytes =
+        recvmsg(socket_fd, &recv_msgs[0].msg_hdr, MSG_DONTWAIT);
+    if (received_bytes >= 0)
+      recv_msgs[0].msg_len = received_bytes;
+    received = received_bytes < 0 ? -1 : 1;
+#endif
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        log(MessageType::MSG_CRIT,
+            fmt::sprintf("recvmmsg() error: %s", strerror(errno)));
+      return;
+    }
+
+    for (int i = 0; i < received; i++) {
+      handle_segment(family, recv_packets[i], recv_msgs[i].msg_len,
+                     &recv_sources[i]);
+
+      // The kernel has shrunk it to the size of the address.
+      recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+  }
+}
+
+/// Parses a received segment and finishes the check it belongs to
+///
+/// SYN-ACK passes the check, RST fails it. Both must acknowledge the
+/// sequence number of our last SYN. Anything else is ignored.
+void Healthcheck_tcp::handle_segment(int family, unsigned char *raw_packet,
+                                     ssize_t received_bytes,
+                                     struct sockaddr_storage *source) {
+  ssize_t ip_header_len = 0;
+
+  // Calculate offset to TCP in IP, IPv6 raw sockets give no IP header.
+  if (family == AF_INET) {
+    if (received_bytes < (ssize_t)sizeof(struct ip))
+      return;
+    // IHL is the number of 32-bit words, multiply it by 4 to get bytes.
+    ip_header_len = ((struct ip *)raw_packet)->ip_hl << 2;
+  }
+
+  // Buffers are not cleared between packets, don't look at stale data.
+  if (received_bytes < ip_header_len + (ssize_t)sizeof(struct tcphdr))
+    return;
+
+  struct tcphdr *tcp_header = (struct tcphdr *)(raw_packet + ip_header_len);
+  uint16_t our_port = ntohs(tcp_header->th_dport);
+  if (our_port < SYN_PORT_FIRST || !(tcp_header->th_flags & TH_ACK))
+    return;
+
+  for (auto *hc : syn_ports[our_port - SYN_PORT_FIRST]) {
+    if (!hc->is_running || hc->port != ntohs(tcp_header->th_sport) ||
+        ntohl(tcp_header->th_ack) != hc->syn_seq + 1 ||
+        !hc->is_my_address(source))
+      continue;
+
+    if (tcp_header->th_flags & TH_RST)
+      hc->end_check(HealthcheckResult::HC_FAIL,
+                    connect_error_message(ECONNREFUSED));
+    else if (tcp_header->th_flags & TH_SYN)
+      hc->end_check(HealthcheckResult::HC_PASS, "connection successful");
+    return;
+  }
+}
+
+/// The timeout callback for SYN probes
+void Healthcheck_tcp::timeout_callback(evutil_socket_t fd, short what,
+                                       void *arg) {
+  // Make compiler happy
+  (void)(fd);
+  (void)(what);
+
+  Healthcheck_tcp *healthcheck = (Healthcheck_tcp *)arg;
+
+  healthcheck->end_check(
+      HealthcheckResult::HC_FAIL,
+      fmt::sprintf("timeout after %dms", healthcheck->timeout_to_ms()));
+}
+
+/// Overrides end_check() method to clean up things
+void Healthcheck_tcp::end_check(HealthcheckResult result, string message) {
+  if (this->syn_mode) {
+    event_del(&this->timeout_event);
+    if (result != HealthcheckResult::HC_PASS)
+      this->update_source_address();
   }
 
   if (this->bev != NULL) {
-    bufferevent_free(this->bev);
+    this->free_probe_bufferevent(this->bev);
     this->bev = NULL;
   }
 
+  if (this->uring_socket != -1) {
+    this->close_probe_socket(this->uring_socket);
+    this->uring_socket = -1;
+  }
+
   Healthcheck::end_check(result, message);
 }
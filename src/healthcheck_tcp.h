@@ -8,11 +8,37 @@
 #define _CHECK_TCP_HPP_
 
 #include <event2/bufferevent.h>
+#include <event2/event_struct.h>
+#include <netinet/tcp.h>
+#include <random>
 #include <sstream>
 #include <unistd.h>
 #include <vector>
 
 #include "healthcheck.h"
+#include "healthcheck_ping.h"
+#include "uring.h"
+
+// Source ports used for SYN probes. They must not be used by the kernel for
+// its own connections, so keep them outside of net.ipv4.ip_local_port_range.
+#define SYN_PORT_FIRST 61000
+#define SYN_PORT_LAST 65535
+
+// Maximum number of packets handled by a single sendmmsg() or recvmmsg().
+#define SYN_BATCH_SIZE 1024
+
+// Space for each received packet, enough for IP and TCP headers.
+#define SYN_RECV_SIZE 128
+
+// Receive buffer of SYN probe sockets.
+#define SYN_RCVBUF_SIZE (16 * 1024 * 1024)
+
+// The SYN segment sent by probes. It carries the MSS option so that it looks
+// like one sent by an ordinary connect().
+struct syn_segment {
+  struct tcphdr tcp_header;
+  uint8_t options[4];
+};
 
 class Healthcheck_tcp : public Healthcheck {
 
@@ -22,15 +48,78 @@ public:
                   string *ip_address);
   static void check_tcp_callback(struct evtcp_request *req, void *arg);
   int schedule_healthcheck(struct timespec *now);
+  static int initialize();
+  static void destroy();
+  static void flush();
 
 protected:
   static void event_callback(struct bufferevent *bev, short events, void *arg);
+  static void syn_callback(evutil_socket_t fd, short what, void *arg);
+  static void timeout_callback(evutil_socket_t fd, short what, void *arg);
+  static void uring_connect_callback(int result, void *arg);
+  static bool check_local_port_range();
+  static int open_syn_socket(int family);
+  static void flush_queue(int family);
+  static void handle_segment(int family, unsigned char *raw_packet,
+                             ssize_t received_bytes,
+                             struct sockaddr_storage *source);
+  string get_probe_key();
+  void init_probe();
+  void assign_syn_port();
+  bool lookup_source_address(struct sockaddr_storage *source);
+  bool find_source_address();
+  void update_source_address();
+  int schedule_connect();
+  int schedule_uring();
+  int schedule_syn();
+  bool is_my_address(const struct sockaddr_storage *source);
   void end_check(HealthcheckResult result, string message);
+  bool opens_probe_socket();
 
   // Members
 private:
   bufferevent *bev;
   int port;
+
+  // Connection driven by io_uring instead of bufferevent.
+  evutil_socket_t uring_socket;
+  struct UringRequest uring_request;
+
+  // Raw sockets shared by all checks in SYN mode, -1 if not available.
+  static int syn_socket4;
+  static int syn_socket6;
+  static struct event *syn_ev4;
+  static struct event *syn_ev6;
+  static std::mt19937 random_generator;
+
+  // Replies are mapped back to checks by our source port. Each check gets
+  // one port in init_probe(), different from other checks probing the same
+  // destination. The reply is then verified by the acknowledged sequence
+  // number.
+  static vector<vector<Healthcheck_tcp *>> syn_ports;
+  static unsigned int next_syn_port;
+
+  // SYN segments built during one scheduler pass, sent by flush().
+  static vector<Healthcheck_tcp *> syn_queue4;
+  static vector<Healthcheck_tcp *> syn_queue6;
+  static vector<struct mmsghdr> send_msgs;
+  static vector<struct iovec> send_iovecs;
+
+  // Preallocated buffers for recvmmsg().
+  static unsigned char (*recv_packets)[SYN_RECV_SIZE];
+  static struct sockaddr_storage *recv_sources;
+  static struct mmsghdr *recv_msgs;
+  static struct iovec *recv_iovecs;
+
+  bool syn_mode;
+  uint16_t syn_port;
+  uint32_t syn_seq;
+  struct syn_segment syn_request;
+  // Raw sockets need no destination port, but the source address to
+  // calculate the checksum.
+  struct sockaddr_storage syn_destination;
+  struct sockaddr_storage syn_source;
+  struct event timeout_event;
 };
 
 #endif
@@ -23,6 +23,8 @@ using namespace std;
 // Linked from testtool.cpp
 extern message_queue *pfctl_mq;
 
+bool LbPool::defer_initial_syncs = false;
+
 FaultPolicy fault_policy_from_string(string s) {
   if (s == "force_down")
     return FaultPolicy::FORCE_DOWN;
@@ -61,6 +63,8 @@ LbPool::LbPool(string name, nlohmann::json &config,
   if (this->backup_pool_name != "") {
     this->fault_policy = FaultPolicy::BACKUP_POOL;
   }
+  this->priority = check_priority_from_string(
+      safe_get<string>(config, "priority", "normal"));
 
   // Perform some checks to verify if this is really an LB Pool and not
   // something else like a SNAT rule.
@@ -75,6 +79,7 @@ LbPool::LbPool(string name, nlohmann::json &config,
     throw(NotLbPoolException("No protocol_port configured!"));
 
   this->state = LbPoolState::STATE_DOWN;
+  this->up_nodes_generation = 0;
 
   // If this Pool has no healthchecks then force nodes to be always up.
   // This is required to have testool manage all LB Pools.
@@ -94,8 +99,10 @@ LbPool::LbPool(string name, nlohmann::json &config,
   }
 
   log(MessageType::MSG_INFO, this,
-      fmt::sprintf("min_nodes: %d max_nodes: %d policy: %s state: created",
-                   min_nodes, max_nodes, this->get_fault_policy_string()));
+      fmt::sprintf(
+          "min_nodes: %d max_nodes: %d policy: %s priority: %s state: created",
+          min_nodes, max_nodes, this->get_fault_policy_string(),
+          CheckPriorityNames[static_cast<int>(this->priority)]));
 
   // Glue things together. Please note that children append themselves
   // to property of parent in their own code.
@@ -127,6 +134,7 @@ LbPool::LbPool(string name, nlohmann::json &config,
   // entries which are not in config file anymore? Maybe it has no checks
   // assigned?
   pf_synced = false;
+  pf_initial_sync = true;
   pool_logic(NULL);
 }
 
@@ -281,6 +289,7 @@ void LbPool::pool_logic(LbNode *last_node) {
     // Log only if state has changed.
     if (wanted_nodes != up_nodes) {
       up_nodes = wanted_nodes;
+      up_nodes_generation++;
 
       string up_nodes_str;
       for (auto node : up_nodes) {
@@ -308,8 +317,10 @@ void LbPool::pool_logic(LbNode *last_node) {
 // Update pfctl to last known wanted_nodes if necessary.
 void LbPool::update_pfctl(void) {
   // Update primary LB Pool
-  if (!pf_synced) {
+  if (!pf_synced && !(pf_initial_sync && defer_initial_syncs)) {
     pf_synced = send_message(pfctl_mq, name, pf_name, nodes, up_nodes);
+    if (pf_synced)
+      pf_initial_sync = false;
     if (!pf_synced)
       log(MessageType::MSG_INFO, this, fmt::sprintf("sync: delayed"));
     else
@@ -325,14 +336,24 @@ void LbPool::update_pfctl(void) {
   }
 }
 
-// Force syncing of LB Pools which have no Health Checks.
+// Force syncing of LB Pools which have no Health Checks or were never synced.
 void LbPool::sync_no_hc(void) {
-  if (!has_hcs && !pf_synced) {
-    log(MessageType::MSG_DEBUG, this, "sync: forcing for non-hc pool");
+  if ((!has_hcs || pf_initial_sync) && !pf_synced) {
+    log(MessageType::MSG_DEBUG, this,
+        has_hcs ? "sync: initial" : "sync: forcing for non-hc pool");
     this->update_pfctl();
   }
 }
 
+// Don't sync LB Pools to pf when they are created, but all at once later by
+// sync_no_hc(). LB Pools are then synced with their Backup Pools known and
+// those not fitting into the queue of pfctl worker are retried by the next
+// run of the syncer, instead of each one failing while loading the
+// configuration.
+void LbPool::set_defer_initial_syncs(bool defer) {
+  defer_initial_syncs = defer;
+}
+
 string LbPool::get_state_string() {
   return LbPoolStateNames[static_cast<int>(state)];
 }
@@ -345,4 +366,4 @@ set<string> LbPool::get_up_nodes_names() {
   return ret;
 }
 
-set<LbNode *> LbPool::get_up_nodes() { return up_nodes; }
+const set<LbNode *> &LbPool::get_up_nodes() { return up_nodes; }
@@ -55,13 +55,14 @@ public:
   void pool_logic(LbNode *last_node);
   void finalize_healthchecks();
   void sync_no_hc();
+  static void set_defer_initial_syncs(bool defer);
   void update_pfctl();
   string get_state_string();
   size_t count_up_nodes();
   string get_backup_pool_state();
   string get_fault_policy_string();
   set<string> get_up_nodes_names();
-  set<LbNode *> get_up_nodes();
+  const set<LbNode *> &get_up_nodes();
 
   // Members
 public:
@@ -72,6 +73,8 @@ public:
   string pf_name;
   LbPoolState state;
   set<class LbNode *> nodes;
+  unsigned long up_nodes_generation; // Increased on each change of up_nodes.
+  CheckPriority priority; // Of all checks of this LB Pool.
 
 private:
   string backup_pool_name;
@@ -83,6 +86,8 @@ private:
   FaultPolicy fault_policy;
   map<std::string, LbPool *> *all_lb_pools;
   bool pf_synced;
+  bool pf_initial_sync; // Not synced since creation.
+  static bool defer_initial_syncs;
   bool has_hcs; // Shortcut so we don't have to iterate over all nodes to find out
                 // if there are any healthchecks.
   set<class LbNode *> up_nodes;
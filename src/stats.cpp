@@ -0,0 +1,100 @@
+//
+// Testtool - Statistics
+//
+// Copyright (c) 2018 InnoGames GmbH
+//
+
+#define FMT_HEADER_ONLY
+
+#include <fmt/format.h>
+#include <fmt/printf.h>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdio.h>
+
+#include "healthcheck.h"
+#include "msg.h"
+#include "stats.h"
+
+using namespace std;
+
+struct Stats stats;
+
+#ifdef __linux__
+/// Reads the TCP line of /proc/net/sockstat or sockstat6 into the json
+///
+/// The line looks like "TCP: inuse 5 orphan 0 tw 2 alloc 7 mem 1".
+static void read_sockstat(const char *file_name, const string &prefix,
+                          nlohmann::json &result) {
+  ifstream sockstat(file_name);
+  string line;
+
+  while (getline(sockstat, line)) {
+    istringstream fields(line);
+    string name;
+    long value;
+
+    fields >> name;
+    if (name != prefix)
+      continue;
+    while (fields >> name >> value) {
+      if (name == "inuse")
+        result["tcp_sockets"] = result.value("tcp_sockets", 0L) + value;
+      else if (name == "tw")
+        result["tcp_time_wait"] = value;
+    }
+  }
+}
+#endif
+
+/// Collects all statistics
+///
+/// Besides our own gauges, the usage of TCP sockets by the whole system is
+/// included if the system tells it. TIME_WAIT sockets and sockets in use,
+/// compared with the number of local ports and source addresses, show how
+/// close probes are to running out of ephemeral ports.
+nlohmann::json stats_to_json() {
+  nlohmann::json result = {
+      {"probe_sockets", stats.probe_sockets.load()},
+      {"probe_resets", stats.probe_resets.load()},
+      {"source_addresses", Healthcheck::count_source_addresses()},
+      {"shared_checks", Healthcheck::count_shared_checks()},
+      {"checks_running", stats.checks_running.load()},
+      {"checks_deferred", stats.checks_deferred.load()},
+      {"deferrals", stats.deferrals.load()},
+      {"destination_deferrals", stats.destination_deferrals.load()},
+      {"deferral_ms", stats.deferral_ms.load()},
+      {"loop_lag_ms", stats.loop_lag_ms.load()},
+      {"overload_level", stats.overload_level.load()},
+  };
+
+#ifdef __linux__
+  // IPv4 and IPv6 share TIME_WAIT sockets, sockstat6 doesn't show them.
+  read_sockstat("/proc/net/sockstat", "TCP:", result);
+  read_sockstat("/proc/net/sockstat6", "TCP6:", result);
+
+  ifstream port_range("/proc/sys/net/ipv4/ip_local_port_range");
+  int first, last;
+  if (port_range >> first >> last)
+    result["local_ports"] = last - first + 1;
+#endif
+
+  return result;
+}
+
+/// Dumps statistics to a file, to be read by monitoring.
+void dump_stats() {
+  ofstream stats_file("/var/run/iglb/testtool_stats.json.new",
+                      ios_base::out | ios_base::trunc);
+
+  stats_file << setw(4) << stats_to_json() << std::endl;
+
+  if (stats_file.good()) {
+    rename("/var/run/iglb/testtool_stats.json.new",
+           "/var/run/iglb/testtool_stats.json");
+  } else {
+    log(MessageType::MSG_CRIT,
+        fmt::sprintf("Could not write stats file, will retry next time."));
+  }
+}
@@ -0,0 +1,44 @@
+//
+// Testtool - Statistics
+//
+// Copyright (c) 2018 InnoGames GmbH
+//
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <atomic>
+#include <nlohmann/json.hpp>
+#include <string>
+
+using namespace std;
+
+// Gauges and counters exported in the stats file. Some of them are updated
+// by TLS workers, so all of them are atomic.
+struct Stats {
+  // Probe connections which are open right now.
+  std::atomic<long> probe_sockets{0};
+  // Probe connections closed with RST instead of FIN.
+  std::atomic<long> probe_resets{0};
+  // Checks which are running right now.
+  std::atomic<long> checks_running{0};
+  // Checks which were due but had to wait for the probe budget, at the
+  // last run of the scheduler and in total.
+  std::atomic<long> checks_deferred{0};
+  std::atomic<long> deferrals{0};
+  // Deferrals because of too many checks running against the destination.
+  std::atomic<long> destination_deferrals{0};
+  // How late the oldest deferred check was at the last run of the
+  // scheduler (ms).
+  std::atomic<long> deferral_ms{0};
+  // Smoothed lag of the main loop (ms) and overload level derived from it.
+  std::atomic<long> loop_lag_ms{0};
+  std::atomic<long> overload_level{0};
+};
+
+extern struct Stats stats;
+
+nlohmann::json stats_to_json();
+void dump_stats();
+
+#endif
@@ -8,6 +8,7 @@
 
 #include <boost/interprocess/ipc/message_queue.hpp>
 #include <event2/event-config.h>
+#include <event2/thread.h>
 #include <event2/util.h>
 #include <event2/visibility.h>
 #include <fmt/format.h>
@@ -30,12 +31,17 @@
 
 #include "config.h"
 #include "healthcheck.h"
+#include "healthcheck_dns.h"
+#include "healthcheck_http.h"
 #include "healthcheck_ping.h"
+#include "healthcheck_tcp.h"
 #include "lb_node.h"
 #include "lb_pool.h"
 #include "msg.h"
 #include "pfctl_worker.h"
+#include "stats.h"
 #include "testtool.h"
+#include "uring.h"
 
 using namespace std;
 using namespace boost::interprocess;
@@ -124,6 +130,13 @@ void TestTool::load_config() {
   config_file >> config;
   config_file.close();
 
+  // Checks created from an earlier configuration must not lead probes of the
+  // new ones.
+  Healthcheck::forget_probes();
+
+  // Sync all LB Pools after all of them are created.
+  LbPool::set_defer_initial_syncs(true);
+
   for (const auto &lb_pool : config.items()) {
     string name = lb_pool.key();
     try {
@@ -137,6 +150,9 @@ void TestTool::load_config() {
                        ex.what()));
     }
   }
+
+  LbPool::set_defer_initial_syncs(false);
+  sync_lbpools_without_healthchecks();
 }
 
 /// Schedules healthchecks on all lbnodes.
@@ -165,11 +181,21 @@ void TestTool::schedule_healthchecks() {
 
   // Get time once and assume all checks started at this time.
   clock_gettime(CLOCK_MONOTONIC, &now);
+  Healthcheck::measure_loop_lag(&now);
 
   // Iterate over all lbpools and schedule healthchecks.
   for (auto &lbpool : lb_pools) {
     lbpool.second->schedule_healthchecks(&now);
   }
+
+  // Start due checks within the probe budget, oldest first.
+  Healthcheck::admit_due_checks(&now);
+
+  // Ping requests, SYN probes and io_uring operations are only queued by the
+  // checks, send them all at once.
+  Healthcheck_ping::flush();
+  Healthcheck_tcp::flush();
+  Uring::flush();
 }
 
 /// Parses the results of healthchecks for all lbpools.
@@ -188,7 +214,7 @@ void TestTool::finalize_healthchecks() {
   }
 }
 
-/// Force syncing of LB Pools which have no Health Checks.
+/// Force syncing of LB Pools which have no Health Checks or were never synced.
 void lbpool_syncer_callback(evutil_socket_t fd, short what, void *arg) {
   // Make compiler happy
   (void)(fd);
@@ -239,6 +265,7 @@ void dump_status_callback(evutil_socket_t fd, short what, void *arg) {
   (void)(what);
 
   ((TestTool *)arg)->dump_status();
+  dump_stats();
 }
 
 TestTool::TestTool(string config_file_name) {
@@ -302,10 +329,12 @@ void TestTool::setup_events() {
   //  10 000 μs =  10ms =  100/s
   // 100 000 μs = 100ms =   10/s
 
-  // Run the healthcheck scheduler multiple times per second.
+  // Run the healthcheck scheduler multiple times per second, how often
+  // depends on the shortest interval of all checks.
   struct timeval healthcheck_scheduler_interval;
   healthcheck_scheduler_interval.tv_sec = 0;
-  healthcheck_scheduler_interval.tv_usec = 100000; // 0.1s
+  healthcheck_scheduler_interval.tv_usec =
+      Healthcheck::get_scheduler_tick() * 1000;
   struct event *healthcheck_scheduler_event = event_new(
       eventBase, -1, EV_PERSIST, healthcheck_scheduler_callback, this);
   event_add(healthcheck_scheduler_event, &healthcheck_scheduler_interval);
@@ -350,6 +379,8 @@ void TestTool::setup_events() {
 }
 
 void init_libevent() {
+  // TLS workers hand results over to the main loop from their own threads.
+  evthread_use_pthreads();
   eventBase = event_base_new();
   log(MessageType::MSG_INFO,
       fmt::sprintf("libevent method: %s", event_base_get_method(eventBase)));
@@ -390,15 +421,48 @@ void finish_libssl() {
 
 void usage() {
   cout << "Hi, I'm testtool-ng and my arguments are:" << endl;
+  cout << " -c  - maximum number of checks running at once, 0 for no limit "
+          "(default: 0)"
+       << endl;
+  cout << " -d  - maximum number of checks running at once against one "
+          "address, 0 for no limit (default: 0)"
+       << endl;
   cout << " -f  - specify an alternate configuration file to load" << endl;
+  cout << " -H  - spread checks over their intervals by hash of LB Pool, LB "
+          "Node and check instead of randomly"
+       << endl;
   cout << " -h  - helps you with this helpful help message" << endl;
+  cout << " -i  - number of ICMP datagram sockets per address family for "
+          "ping checks on Linux, 0 uses raw sockets (default: 1)"
+       << endl;
+  cout << " -l  - maximum number of open probe sockets (default: "
+          "RLIMIT_NOFILE minus 256 if -c, -d or -r is given, otherwise no "
+          "limit)"
+       << endl;
   cout << " -n  - do not perform any pfctl actions" << endl;
   cout << " -p  - display pfctl commands even if skipping pfctl actions"
        << endl;
+  cout << " -r  - maximum number of checks started per second, 0 for no "
+          "limit (default: 0)"
+       << endl;
+  cout << " -s  - comma separated list of source addresses for tcp, except "
+          "SYN probes, and http(s) checks to use in turns (default: chosen "
+          "by the kernel)"
+       << endl;
+  cout << " -t  - number of TLS worker threads for https checks, 0 runs "
+          "them in the main loop (default: 0)"
+       << endl;
+  cout << " -u  - size of io_uring submission queue for tcp, http and dns "
+          "checks on Linux, 0 uses libevent (default: 0)"
+       << endl;
   cout << " -v  - be verbose - display loaded lbpools list" << endl;
   cout << " -vv - be more verbose - display every scheduling of a test and "
           "test result"
        << endl;
+  cout << " -w  - spread the first runs of checks over this many ms after "
+          "startup, with -H over at least one interval (default: 0, first "
+          "runs are due after one interval)"
+       << endl;
 }
 
 int main(int argc, char *argv[]) {
@@ -408,22 +472,70 @@ int main(int argc, char *argv[]) {
   ;
 
   string config_file_name = "/etc/iglb/lbpools.json";
+  int tls_workers = 0;
+  int ping_sockets = 1;
+  int uring_entries = 0;
+  int probe_rate = 0;
+  int max_running_checks = 0;
+  int max_probe_sockets = 0;
+  int max_destination_checks = 0;
+  int warm_up = 0;
 
   int opt;
-  while ((opt = getopt(argc, argv, "hnpvf:")) != -1) {
+  while ((opt = getopt(argc, argv, "Hhnpvc:d:f:i:l:r:s:t:u:w:")) != -1) {
     switch (opt) {
+    case 'c':
+      max_running_checks = atoi(optarg);
+      break;
+    case 'd':
+      max_destination_checks = atoi(optarg);
+      break;
     case 'f':
       config_file_name = optarg;
       break;
+    case 'i':
+      ping_sockets = atoi(optarg);
+      break;
+    case 'l':
+      max_probe_sockets = atoi(optarg);
+      break;
     case 'n':
       pf_action = false;
       break;
     case 'p':
       verbose_pfctl++;
       break;
+    case 'r':
+      probe_rate = atoi(optarg);
+      break;
+    case 's': {
+      istringstream source_addresses(optarg);
+      string source_address;
+      while (getline(source_addresses, source_address, ',')) {
+        if (!Healthcheck::add_source_address(source_address)) {
+          log(MessageType::MSG_CRIT,
+              fmt::sprintf("Unable to parse source address '%s', terminating!",
+                           source_address));
+          exit(EXIT_FAILURE);
+        }
+      }
+      break;
+    }
+    case 't':
+      tls_workers = atoi(optarg);
+      break;
+    case 'u':
+      uring_entries = atoi(optarg);
+      break;
+    case 'w':
+      warm_up = atoi(optarg);
+      break;
     case 'v':
       verbose++;
       break;
+    case 'H':
+      Healthcheck::set_hash_phases(true);
+      break;
     case 'h':
       usage();
       exit(EXIT_SUCCESS);
@@ -465,14 +577,45 @@ int main(int argc, char *argv[]) {
       evsignal_new(eventBase, SIGUSR1, signal_handler, event_self_cbarg());
   evsignal_add(ev_sigusr1, NULL);
 
-  if (!Healthcheck_ping::initialize()) {
+  if (!Uring::initialize(uring_entries)) {
+    log(MessageType::MSG_CRIT, "Unable to initialize io_uring, terminating!");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!Healthcheck_ping::initialize(ping_sockets)) {
     log(MessageType::MSG_CRIT,
         "Unable to initialize Healthcheck_ping, terminating!");
     exit(EXIT_FAILURE);
   }
 
+  if (!Healthcheck_tcp::initialize()) {
+    log(MessageType::MSG_CRIT,
+        "Unable to initialize Healthcheck_tcp, terminating!");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!Healthcheck_dns::initialize()) {
+    log(MessageType::MSG_CRIT,
+        "Unable to initialize Healthcheck_dns, terminating!");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!Healthcheck_https::initialize(tls_workers)) {
+    log(MessageType::MSG_CRIT,
+        "Unable to initialize Healthcheck_https, terminating!");
+    exit(EXIT_FAILURE);
+  }
+
+  // Without any limit checks are started right away by the scheduler.
+  if (probe_rate || max_running_checks || max_probe_sockets ||
+      max_destination_checks)
+    Healthcheck::set_probe_budget(probe_rate, max_running_checks,
+                                  max_probe_sockets, max_destination_checks);
+
   auto tool = new TestTool(config_file_name);
   tool->load_config();
+  // Counted from now, when all checks are created.
+  Healthcheck::start_warm_up(warm_up);
 
   tool->setup_events();
   log(MessageType::MSG_INFO, "Entering the main loop...");
@@ -483,6 +626,10 @@ int main(int argc, char *argv[]) {
   log(MessageType::MSG_INFO, "Stopping testtool");
 
   Healthcheck_ping::destroy();
+  Healthcheck_tcp::destroy();
+  Healthcheck_dns::destroy();
+  Healthcheck_https::destroy();
+  Uring::destroy();
 
   finish_libevent();
   finish_libssl();
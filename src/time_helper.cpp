@@ -11,6 +11,18 @@ int timespec_diff_ms(struct timespec *a, struct timespec *b) {
   return diff_msec;
 }
 
+void timespec_add_ms(struct timespec *t, int ms) {
+  t->tv_sec += ms / 1000;
+  t->tv_nsec += (ms % 1000) * 1000000L;
+  if (t->tv_nsec >= 1000000000) {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000;
+  } else if (t->tv_nsec < 0) {
+    t->tv_sec--;
+    t->tv_nsec += 1000000000;
+  }
+}
+
 // long timespec_to_ms(struct timespec *t) {
 //  return (t->tv_sec * 1000) + (t->tv_nsec / 1000000);
 //}
@@ -9,6 +9,7 @@
 #include <sys/time.h>
 
 int timespec_diff_ms(struct timespec *a, struct timespec *b);
+void timespec_add_ms(struct timespec *t, int ms);
 // int timespec_to_ms(struct timespec *t);
 int timeval_to_ms(struct timeval *t);
 
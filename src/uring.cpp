@@ -0,0 +1,319 @@
+//
+// Testtool - io_uring Engine
+//
+// Copyright (c) 2018 InnoGames GmbH
+//
+
+#define FMT_HEADER_ONLY
+
+#include <assert.h>
+#include <errno.h>
+#include <event2/event.h>
+#include <fmt/format.h>
+#include <fmt/printf.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <sys/eventfd.h>
+#endif
+
+#include "msg.h"
+#include "time_helper.h"
+#include "uring.h"
+
+using namespace std;
+
+extern struct event_base *eventBase;
+
+// In the .h file there are only declarations of static variables, here we have
+// definitions.
+bool Uring::enabled = false;
+int Uring::event_fd = -1;
+struct event *Uring::ev = NULL;
+
+/// Tells if checks should use the ring instead of libevent for their I/O.
+bool Uring::is_enabled() { return enabled; }
+
+#ifdef HAVE_LIBURING
+
+struct io_uring Uring::ring;
+unsigned int Uring::close_flags = 0;
+std::map<int, struct __kernel_timespec> Uring::timeouts;
+
+/// Sets up the ring, should be called once at the startup of testtool.
+///
+/// The ring is used only if entries is not 0. Should the kernel not
+/// support it, checks keep using libevent.
+bool Uring::initialize(unsigned int entries) {
+  if (entries == 0)
+    return true;
+
+  // Each check has at most an operation and its timeout in flight, there
+  // are usually more checks running than the submission queue holds.
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+  params.cq_entries = entries * 8;
+
+  int ret = io_uring_queue_init_params(entries, &ring, &params);
+  if (ret < 0) {
+    log(MessageType::MSG_INFO,
+        fmt::sprintf("io_uring not available: %s, using libevent",
+                     strerror(-ret)));
+    return true;
+  }
+
+#ifdef IORING_FEAT_CQE_SKIP
+  // Successful closing needs no completion.
+  if (params.features & IORING_FEAT_CQE_SKIP)
+    close_flags = IOSQE_CQE_SKIP_SUCCESS;
+#endif
+
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd == -1) {
+    log(MessageType::MSG_CRIT,
+        fmt::sprintf("io_uring eventfd() error: %s", strerror(errno)));
+    return false;
+  }
+  ret = io_uring_register_eventfd(&ring, event_fd);
+  if (ret < 0) {
+    log(MessageType::MSG_CRIT, fmt::sprintf("io_uring eventfd error: %s",
+                                            strerror(-ret)));
+    return false;
+  }
+
+  // Create an event and make it pending.
+  ev = event_new(eventBase, event_fd, EV_READ | EV_PERSIST, Uring::callback,
+                 NULL);
+  event_add(ev, NULL);
+
+  enabled = true;
+  log(MessageType::MSG_DEBUG,
+      fmt::sprintf("io_uring initialized, entries: %d", entries));
+  return true;
+}
+
+/// Tears down the ring, should be called when testtool terminates.
+void Uring::destroy() {
+  if (!enabled)
+    return;
+
+  event_del(ev);
+  event_free(ev);
+  ::close(event_fd);
+  io_uring_queue_exit(&ring);
+  enabled = false;
+}
+
+/// Gets a submission queue entry
+///
+/// An operation with timeout takes two entries, they must be submitted
+/// together. Entries queued so far are submitted to make room if necessary.
+/// Returns NULL if the queue is still full, the kernel has not consumed
+/// what was submitted before.
+struct io_uring_sqe *Uring::get_sqe(const struct timeval *timeout) {
+  unsigned int needed = (timeout == NULL) ? 1 : 2;
+  if (io_uring_sq_space_left(&ring) < needed) {
+    flush();
+    if (io_uring_sq_space_left(&ring) < needed)
+      return NULL;
+  }
+
+  return io_uring_get_sqe(&ring);
+}
+
+/// Ties a prepared entry to its request and links the timeout to it
+///
+/// get_sqe() has made sure that there is room for the timeout.
+void Uring::queue(struct io_uring_sqe *sqe, struct UringRequest *request,
+                  const struct timeval *timeout) {
+  io_uring_sqe_set_data(sqe, request);
+  if (timeout == NULL)
+    return;
+
+  int timeout_ms = timeval_to_ms((struct timeval *)timeout);
+  auto it = timeouts.find(timeout_ms);
+  if (it == timeouts.end()) {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout->tv_sec;
+    ts.tv_nsec = timeout->tv_usec * 1000;
+    it = timeouts.emplace(timeout_ms, ts).first;
+  }
+
+  // The completion of the timeout itself is of no interest, its request is
+  // NULL.
+  io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+  struct io_uring_sqe *timeout_sqe = io_uring_get_sqe(&ring);
+  io_uring_prep_link_timeout(timeout_sqe, &it->second, 0);
+  io_uring_sqe_set_data(timeout_sqe, NULL);
+}
+
+bool Uring::connect(struct UringRequest *request, int fd,
+                    const struct sockaddr *address, socklen_t address_len,
+                    const struct timeval *timeout) {
+  struct io_uring_sqe *sqe = get_sqe(timeout);
+  if (sqe == NULL)
+    return false;
+  io_uring_prep_connect(sqe, fd, address, address_len);
+  queue(sqe, request, timeout);
+  return true;
+}
+
+/// Gets the final result of connect()
+///
+/// Like libevent, don't trust the completion alone, a failed connection
+/// attempt can be reported as finished. The socket error tells the truth.
+int Uring::connect_result(int result, int fd) {
+  if (result != 0)
+    return result;
+
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+    return -errno;
+  return -error;
+}
+
+bool Uring::send(struct UringRequest *request, int fd, const void *buffer,
+                 size_t length, const struct timeval *timeout) {
+  struct io_uring_sqe *sqe = get_sqe(timeout);
+  if (sqe == NULL)
+    return false;
+  io_uring_prep_send(sqe, fd, buffer, length, MSG_NOSIGNAL);
+  queue(sqe, request, timeout);
+  return true;
+}
+
+bool Uring::recv(struct UringRequest *request, int fd, void *buffer,
+                 size_t length, const struct timeval *timeout) {
+  struct io_uring_sqe *sqe = get_sqe(timeout);
+  if (sqe == NULL)
+    return false;
+  io_uring_prep_recv(sqe, fd, buffer, length, 0);
+  queue(sqe, request, timeout);
+  return true;
+}
+
+bool Uring::sendmsg(struct UringRequest *request, int fd,
+                    const struct msghdr *msg) {
+  struct io_uring_sqe *sqe = get_sqe(NULL);
+  if (sqe == NULL)
+    return false;
+  io_uring_prep_sendmsg(sqe, fd, msg, 0);
+  queue(sqe, request, NULL);
+  return true;
+}
+
+/// Closes the socket through the ring, or right away if the ring is full.
+void Uring::close(int fd) {
+  struct io_uring_sqe *sqe = get_sqe(NULL);
+  if (sqe == NULL) {
+    ::close(fd);
+    return;
+  }
+  io_uring_prep_close(sqe, fd);
+  queue(sqe, NULL, NULL);
+  io_uring_sqe_set_flags(sqe, close_flags);
+}
+
+/// Submits all queued operations with a single syscall
+///
+/// Should be called after each scheduler pass.
+void Uring::flush() {
+  if (!enabled)
+    return;
+
+  int ret = io_uring_submit(&ring);
+  if (ret < 0)
+    log(MessageType::MSG_CRIT,
+        fmt::sprintf("io_uring_submit() error: %s", strerror(-ret)));
+}
+
+/// Libevent callback for the ring
+///
+/// Hands over all completions to callbacks of their requests. Those often
+/// queue further operations, which are submitted at the end.
+void Uring::callback(evutil_socket_t fd, short what, void *arg) {
+  (void)(arg);
+  struct io_uring_cqe *cqes[URING_BATCH_SIZE];
+  struct UringRequest *requests[URING_BATCH_SIZE];
+  int results[URING_BATCH_SIZE];
+  uint64_t counter;
+
+  if (!(what & EV_READ))
+    return;
+
+  // Reset the eventfd before looking at the queue, so that no completion is
+  // missed.
+  if (read(fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+    log(MessageType::MSG_CRIT,
+        fmt::sprintf("io_uring eventfd read error: %s", strerror(errno)));
+
+  while (true) {
+    unsigned int count = io_uring_peek_batch_cqe(&ring, cqes, URING_BATCH_SIZE);
+    if (count == 0)
+      break;
+
+    // Free the completion queue before callbacks possibly submit more.
+    for (unsigned int i = 0; i < count; i++) {
+      requests[i] = (struct UringRequest *)io_uring_cqe_get_data(cqes[i]);
+      results[i] = cqes[i]->res;
+    }
+    io_uring_cq_advance(&ring, count);
+
+    for (unsigned int i = 0; i < count; i++) {
+      if (requests[i] != NULL)
+        requests[i]->callback(results[i], requests[i]->arg);
+    }
+  }
+
+  flush();
+}
+
+#else
+
+/// Without liburing the ring is never enabled.
+bool Uring::initialize(unsigned int entries) {
+  if (entries > 0)
+    log(MessageType::MSG_INFO,
+        "io_uring support not compiled in, using libevent");
+  return true;
+}
+
+void Uring::destroy() {}
+
+void Uring::flush() {}
+
+bool Uring::connect(struct UringRequest *, int, const struct sockaddr *,
+                    socklen_t, const struct timeval *) {
+  assert(false);
+  return false;
+}
+
+bool Uring::send(struct UringRequest *, int, const void *, size_t,
+                 const struct timeval *) {
+  assert(false);
+  return false;
+}
+
+bool Uring::recv(struct UringRequest *, int, void *, size_t,
+                 const struct timeval *) {
+  assert(false);
+  return false;
+}
+
+bool Uring::sendmsg(struct UringRequest *, int, const struct msghdr *) {
+  assert(false);
+  return false;
+}
+
+int Uring::connect_result(int, int) {
+  assert(false);
+  return 0;
+}
+
+void Uring::close(int) { assert(false); }
+
+void Uring::callback(evutil_socket_t, short, void *) {}
+
+#endif
@@ -0,0 +1,80 @@
+//
+// Testtool - io_uring Engine
+//
+// Copyright (c) 2018 InnoGames GmbH
+//
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <event2/event.h>
+#include <map>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// Maximum number of completions handled at once.
+#define URING_BATCH_SIZE 1024
+
+// An operation submitted to the ring. It is embedded in the object which
+// has started it and passed back to its callback on completion, the same
+// way libevent events are. The result is what the syscall would return, or
+// negated errno. Operations cancelled by their timeout get -ECANCELED.
+struct UringRequest {
+  void (*callback)(int result, void *arg);
+  void *arg;
+};
+
+class Uring {
+
+  // Methods
+public:
+  static bool initialize(unsigned int entries);
+  static void destroy();
+  static bool is_enabled();
+  static void flush();
+
+  // Operations are only queued, flush() submits all of them at once. Each
+  // one is cancelled if it does not complete within given timeout. They
+  // return false if the submission queue is full.
+  static bool connect(struct UringRequest *request, int fd,
+                      const struct sockaddr *address, socklen_t address_len,
+                      const struct timeval *timeout);
+  static int connect_result(int result, int fd);
+  static bool send(struct UringRequest *request, int fd, const void *buffer,
+                   size_t length, const struct timeval *timeout);
+  static bool recv(struct UringRequest *request, int fd, void *buffer,
+                   size_t length, const struct timeval *timeout);
+  static bool sendmsg(struct UringRequest *request, int fd,
+                      const struct msghdr *msg);
+  // Closing has no result to wait for, nor can it fail.
+  static void close(int fd);
+
+protected:
+  static void callback(evutil_socket_t fd, short what, void *arg);
+#ifdef HAVE_LIBURING
+  static struct io_uring_sqe *get_sqe(const struct timeval *timeout);
+  static void queue(struct io_uring_sqe *sqe, struct UringRequest *request,
+                    const struct timeval *timeout);
+#endif
+
+  // Members
+private:
+  static bool enabled;
+#ifdef HAVE_LIBURING
+  static struct io_uring ring;
+  static unsigned int close_flags;
+  // Linked timeouts are read by the kernel only on submission, keep one
+  // for each distinct value.
+  static std::map<int, struct __kernel_timespec> timeouts;
+#endif
+  // The kernel signals completions through this eventfd, so that they are
+  // handled by the main loop like any other event.
+  static int event_fd;
+  static struct event *ev;
+};
+
+#endif
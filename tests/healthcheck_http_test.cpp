@@ -0,0 +1,169 @@
+//
+// Tests for Healthcheck_http
+//
+
+#include <boost/interprocess/ipc/message_queue.hpp>
+#include <event2/buffer.h>
+#include <gtest/gtest.h>
+#include <string>
+
+#include "healthcheck_http.h"
+#include "lb_node.h"
+#include "lb_pool.h"
+#include "testtool_test.h"
+
+using namespace std;
+
+// An HTTP check which keeps the result of its probe instead of handling it.
+class HttpProbe : public Healthcheck_http {
+public:
+  HttpProbe(const nlohmann::json &config, class LbNode *_parent_lbnode,
+            string *ip_address)
+      : Healthcheck_http(config, _parent_lbnode, ip_address) {
+    input = evbuffer_new();
+  }
+  ~HttpProbe() { evbuffer_free(input); }
+
+  // Feeds a part of the reply, returns true once the probe is finished.
+  bool Receive(string reply, bool at_eof) {
+    evbuffer_add(input, reply.data(), reply.size());
+    return parse_status_line(input, at_eof);
+  }
+
+  void finish_probe(HealthcheckResult result, string message) {
+    finished = true;
+    this->result = result;
+    this->message = message;
+  }
+
+  string &Request() {
+    build_request();
+    return request;
+  }
+
+  size_t CountQuerySegments() { return query_segments.size(); }
+
+  struct evbuffer *input;
+  bool finished = false;
+  HealthcheckResult result;
+  string message;
+};
+
+class HealthcheckHttpTest : public TesttoolTest {
+protected:
+  HttpProbe *CreateProbe(const nlohmann::json &config) {
+    SetUp(true);
+    LbNode *node = GetLbNode(test_lb_pool, "lbnode1");
+    probe = new HttpProbe(config, node, &node->ipv4_address);
+    return probe;
+  }
+
+  virtual void TearDown() {
+    delete probe;
+    TesttoolTest::TearDown();
+  }
+
+  HttpProbe *probe = NULL;
+};
+
+TEST_F(HealthcheckHttpTest, StatusLine) {
+  HttpProbe *hc = CreateProbe({{"hc_type", "http"}});
+
+  EXPECT_TRUE(hc->Receive("HTTP/1.1 200 OK\r\nServer: test\r\n", false));
+  EXPECT_EQ(hc->result, HealthcheckResult::HC_PASS);
+  EXPECT_EQ(hc->message, "HTTP code 200");
+}
+
+// The status line may arrive in multiple parts.
+//
+TEST_F(HealthcheckHttpTest, SplitStatusLine) {
+  HttpProbe *hc = CreateProbe({{"hc_type", "http"}});
+
+  EXPECT_FALSE(hc->Receive("HTTP/1.1 5", false));
+  EXPECT_FALSE(hc->Receive("03 Service Unavailable", false));
+  EXPECT_FALSE(hc->finished);
+  EXPECT_TRUE(hc->Receive("\r\n", false));
+  EXPECT_EQ(hc->result, HealthcheckResult::HC_FAIL);
+  EXPECT_EQ(hc->message, "HTTP code 503");
+}
+
+TEST_F(HealthcheckHttpTest, DrainCode) {
+  HttpProbe *hc = CreateProbe({{"hc_type", "http"}, {"hc_drain_codes", {503}}});
+
+  EXPECT_TRUE(hc->Receive("HTTP/1.0 503 Service Unavailable\r\n", false));
+  EXPECT_EQ(hc->result, HealthcheckResult::HC_DRAIN);
+}
+
+// A reply without end of line is not waited for forever.
+//
+TEST_F(HealthcheckHttpTest, LongStatusLine) {
+  HttpProbe *hc = CreateProbe({{"hc_type", "http"}});
+
+  EXPECT_FALSE(hc->Receive("HTTP/1.1 200 ", false));
+  EXPECT_TRUE(hc->Receive(string(HTTP_STATUS_LINE_MAX, 'x'), false));
+  EXPECT_EQ(hc->result, HealthcheckResult::HC_FAIL);
+  EXPECT_EQ(hc->message, "status line too long");
+}
+
+// The server may close the connection right after the status line.
+//
+TEST_F(HealthcheckHttpTest, StatusLineAtEof) {
+  HttpProbe *hc = CreateProbe({{"hc_type", "http"}});
+
+  EXPECT_FALSE(hc->Receive("HTTP/1.1 200 OK", false));
+  EXPECT_TRUE(hc->Receive("", true));
+  EXPECT_EQ(hc->result, HealthcheckResult::HC_PASS);
+  EXPECT_EQ(hc->message, "HTTP code 200");
+}
+
+TEST_F(HealthcheckHttpTest, EmptyReply) {
+  HttpProbe *hc = CreateProbe({{"hc_type", "http"}});
+
+  EXPECT_TRUE(hc->Receive("", true));
+  EXPECT_EQ(hc->result, HealthcheckResult::HC_FAIL);
+  EXPECT_EQ(hc->message, "no HTTP status line");
+}
+
+// Anything else answering with a number in the right place is not a pass.
+//
+TEST_F(HealthcheckHttpTest, NotHttp) {
+  HttpProbe *hc = CreateProbe({{"hc_type", "http"}});
+
+  EXPECT_TRUE(hc->Receive("SSH-2.0 200 OpenSSH\r\n", false));
+  EXPECT_EQ(hc->result, HealthcheckResult::HC_FAIL);
+  EXPECT_EQ(hc->message, "no HTTP status line");
+}
+
+// Macros which don't change are expanded only once, when the check is
+// created.
+//
+TEST_F(HealthcheckHttpTest, StaticMacros) {
+  HttpProbe *hc = CreateProbe(
+      {{"hc_type", "http"},
+       {"hc_query", "GET /{POOL_NAME}/{NODE_NAME}/{NODE_ADDRESS}/{FOO}"}});
+
+  EXPECT_EQ(hc->CountQuerySegments(), 1);
+  EXPECT_EQ(hc->Request(),
+            "GET /lbpool.example.com/lbnode1/10.0.0.1/{FOO} HTTP/1.1\r\n"
+            "Host: 10.0.0.1\r\nUser-Agent: testtool\r\n"
+            "Connection: close\r\n\r\n");
+}
+
+// Requests with lists of active LB Nodes are rendered again only once the
+// list has changed.
+//
+TEST_F(HealthcheckHttpTest, RequestCache) {
+  base_config[test_lb_pool]["health_checks"][0]["hc_max_failed"] = 1;
+  HttpProbe *hc = CreateProbe({{"hc_type", "http"},
+                               {"hc_query", "GET /{ACTIVE_NODES_NAMES}"}});
+
+  EXPECT_EQ(hc->CountQuerySegments(), 3);
+  EXPECT_EQ(hc->Request().substr(0, 31), "GET /lbnode1,lbnode2,lbnode3 HT");
+
+  // A request rendered already is kept.
+  hc->Request()[5] = 'X';
+  EXPECT_EQ(hc->Request().substr(0, 31), "GET /Xbnode1,lbnode2,lbnode3 HT");
+
+  EndDummyHC(test_lb_pool, "lbnode2", HealthcheckResult::HC_FAIL, false);
+  EXPECT_EQ(hc->Request().substr(0, 23), "GET /lbnode1,lbnode3 HT");
+}
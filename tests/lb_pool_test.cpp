@@ -4,15 +4,22 @@
 
 #include <boost/exception/diagnostic_information.hpp>
 #include <boost/interprocess/ipc/message_queue.hpp>
+#include <chrono>
+#include <event2/thread.h>
+#include <fmt/printf.h>
 #include <fstream>
 #include <gtest/gtest.h>
 #include <openssl/ssl.h>
+#include <thread>
 
 #include "cmake_dirs.h"
 #include "healthcheck_dummy.h"
+#include "healthcheck_http.h"
 #include "lb_node.h"
 #include "lb_pool.h"
+#include "stats.h"
 #include "testtool_test.h"
+#include "time_helper.h"
 
 using namespace std;
 using namespace boost::interprocess;
@@ -27,8 +34,54 @@ boost::interprocess::message_queue *pfctl_mq;
 
 extern bool _pf_is_in_table;
 extern set<string> sent_up_lb_nodes;
-
-class LbPoolTest : public TesttoolTest {};
+extern int sent_messages;
+
+class LbPoolTest : public TesttoolTest {
+protected:
+  // Schedules checks of all LB Pools and starts those admitted by the probe
+  // budget, like testtool does.
+  void ScheduleChecks(struct timespec *now) {
+    for (auto &lb_pool : lb_pools)
+      lb_pool.second->schedule_healthchecks(now);
+    Healthcheck::admit_due_checks(now);
+  }
+
+  // Runs the scheduler given number of times, each time late by given lag.
+  void RunLate(struct timespec *now, int lag, int runs) {
+    for (int i = 0; i < runs; i++) {
+      timespec_add_ms(now, Healthcheck::get_scheduler_tick() + lag);
+      Healthcheck::measure_loop_lag(now);
+    }
+  }
+
+  // Adds an LB Pool like the test one, but with given priority and interval
+  // of its check. Its LB Nodes have other addresses, so that checks don't
+  // share probes with other LB Pools.
+  void AddLbPool(string lb_pool_name, string pf_name, string priority,
+                 int interval) {
+    int index = base_config.size();
+    base_config[lb_pool_name] = base_config[test_lb_pool];
+    base_config[lb_pool_name]["pf_name"] = pf_name;
+    base_config[lb_pool_name]["priority"] = priority;
+    base_config[lb_pool_name]["health_checks"][0]["hc_interval"] = interval;
+    for (auto &node : base_config[lb_pool_name]["nodes"]) {
+      string ip4 = node["ip4"];
+      string ip6 = node["ip6"];
+      node["ip4"] = fmt::sprintf("10.0.%d.%s", index,
+                                 ip4.substr(ip4.rfind('.') + 1));
+      node["ip6"] = fmt::sprintf("2001:db8:%d::%s", 1000 + index,
+                                 ip6.substr(ip6.rfind(':') + 1));
+    }
+  }
+
+  int RunningChecks(string lb_pool_name) {
+    int running = 0;
+    for (LbNode *node : lb_pools[lb_pool_name]->nodes)
+      for (Healthcheck *hc : node->healthchecks)
+        running += ((Healthcheck_dummy *)hc)->dummy_is_running();
+    return running;
+  }
+};
 
 TEST_F(LbPoolTest, InitDown) {
   // On startup LB Nodes are read as down from pfctl.
@@ -354,3 +407,523 @@ TEST_F(LbPoolTest, ForceUpDowntimedDrain) {
   EndDummyHC(test_lb_pool, "lbnode1", HealthcheckResult::HC_PASS, true);
   EXPECT_EQ(UpNodesNames(), set<string>({"lbnode1"}));
 }
+
+// Identical checks of the same LB Node in two LB Pools share the probe,
+// but each LB Pool counts failures on its own.
+//
+TEST_F(LbPoolTest, SharedProbe) {
+  string other_lb_pool = "lbpool2.example.com";
+  base_config[test_lb_pool]["health_checks"][0]["hc_max_failed"] = 1;
+  base_config[other_lb_pool] = base_config[test_lb_pool];
+  base_config[other_lb_pool]["health_checks"][0]["hc_max_failed"] = 2;
+  base_config[other_lb_pool]["pf_name"] = "pool_1";
+
+  SetUp(true);
+
+  // Only checks of the first LB Pool run the probe.
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 3600;
+  EXPECT_TRUE(GetLbNode(test_lb_pool, "lbnode1")
+                  ->healthchecks[0]
+                  ->schedule_healthcheck(&later));
+  EXPECT_FALSE(GetLbNode(other_lb_pool, "lbnode1")
+                   ->healthchecks[0]
+                   ->schedule_healthcheck(&later));
+
+  // The result reaches both LB Pools.
+  EndDummyHC(test_lb_pool, "lbnode1", HealthcheckResult::HC_FAIL, false);
+  EXPECT_EQ(UpNodesNames(), set<string>({"lbnode2", "lbnode3"}));
+  EXPECT_EQ(lb_pools[other_lb_pool]->get_up_nodes_names(),
+            set<string>({"lbnode1", "lbnode2", "lbnode3"}));
+
+  EndDummyHC(test_lb_pool, "lbnode1", HealthcheckResult::HC_FAIL, false);
+  EXPECT_EQ(lb_pools[other_lb_pool]->get_up_nodes_names(),
+            set<string>({"lbnode2", "lbnode3"}));
+}
+
+// LB Pools created while initial syncs are deferred are synced only by the
+// syncer, once.
+//
+TEST_F(LbPoolTest, DeferInitialSyncs) {
+  base_config[test_lb_pool]["health_checks"][0]["hc_max_failed"] = 1;
+  sent_messages = 0;
+  sent_up_lb_nodes.clear();
+  LbPool::set_defer_initial_syncs(true);
+  SetUp(true);
+
+  // Neither creating the LB Pool nor a change of its LB Nodes syncs it.
+  EXPECT_EQ(sent_messages, 0);
+  EndDummyHC(test_lb_pool, "lbnode1", HealthcheckResult::HC_FAIL, false);
+  EXPECT_EQ(sent_messages, 0);
+
+  LbPool::set_defer_initial_syncs(false);
+  lb_pools[test_lb_pool]->sync_no_hc();
+  EXPECT_EQ(sent_messages, 1);
+  EXPECT_EQ(sent_up_lb_nodes, set<string>({"lbnode2", "lbnode3"}));
+
+  // The syncer leaves it alone afterwards.
+  lb_pools[test_lb_pool]->sync_no_hc();
+  EXPECT_EQ(sent_messages, 1);
+}
+
+// Intervals don't define the probe, checks differing only in them share it.
+//
+TEST_F(LbPoolTest, SharedProbeInterval) {
+  string other_lb_pool = "lbpool2.example.com";
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval"] = 1;
+  base_config[other_lb_pool] = base_config[test_lb_pool];
+  base_config[other_lb_pool]["health_checks"][0]["hc_interval"] = 3;
+  base_config[other_lb_pool]["pf_name"] = "pool_1";
+  SetUp(true);
+
+  EXPECT_EQ(Healthcheck::count_shared_checks(), 6);
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 3600;
+  EXPECT_FALSE(GetLbNode(other_lb_pool, "lbnode1")
+                   ->healthchecks[0]
+                   ->schedule_healthcheck(&later));
+
+  // Checks created afterwards get their own probes.
+  Healthcheck::forget_probes();
+  EXPECT_EQ(Healthcheck::count_shared_checks(), 0);
+}
+
+// Failures are confirmed with hc_retry_interval instead of hc_interval.
+//
+TEST_F(LbPoolTest, RetryInterval) {
+  base_config[test_lb_pool]["health_checks"][0]["hc_max_failed"] = 3;
+  base_config[test_lb_pool]["health_checks"][0]["hc_retry_interval"] = 100;
+  SetUp(true);
+
+  Healthcheck *hc = GetLbNode(test_lb_pool, "lbnode1")->healthchecks[0];
+  struct timespec soon;
+  clock_gettime(CLOCK_MONOTONIC, &soon);
+  soon.tv_sec += 1;
+
+  // A healthy LB Node is checked with the regular interval.
+  EXPECT_FALSE(hc->schedule_healthcheck(&soon));
+
+  // The first failure is confirmed quickly.
+  EndDummyHC(test_lb_pool, "lbnode1", HealthcheckResult::HC_FAIL, false);
+  EXPECT_TRUE(hc->schedule_healthcheck(&soon));
+
+  // Once the check passes again the regular interval is used.
+  EndDummyHC(test_lb_pool, "lbnode1", HealthcheckResult::HC_PASS, false);
+  soon.tv_sec += 1;
+  EXPECT_FALSE(hc->schedule_healthcheck(&soon));
+}
+
+// Runs are due on a grid of hc_interval_ms, late runs don't shift it unless
+// they are late by more than an interval.
+//
+TEST_F(LbPoolTest, DriftFreeInterval) {
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval_ms"] = 500;
+  SetUp(true);
+
+  Healthcheck_dummy *hc =
+      (Healthcheck_dummy *)GetLbNode(test_lb_pool, "lbnode1")->healthchecks[0];
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 3600;
+
+  // Missed runs are skipped, the next one is due an interval later.
+  EXPECT_TRUE(hc->schedule_healthcheck(&later));
+  EXPECT_EQ(hc->dummy_next_due_ms(), 500);
+  hc->dummy_end_check(HealthcheckResult::HC_PASS, "dummy_pass", 1);
+
+  // A run late by less than an interval keeps the next one on the grid.
+  timespec_add_ms(&later, 700);
+  EXPECT_TRUE(hc->schedule_healthcheck(&later));
+  EXPECT_EQ(hc->dummy_next_due_ms(), 300);
+  hc->dummy_end_check(HealthcheckResult::HC_PASS, "dummy_pass", 1);
+
+  // A run late by more than an interval starts a new grid.
+  timespec_add_ms(&later, 1000);
+  EXPECT_TRUE(hc->schedule_healthcheck(&later));
+  EXPECT_EQ(hc->dummy_next_due_ms(), 500);
+}
+
+// Adaptive checks double their interval up to hc_interval_max while they
+// pass, and return to hc_interval on a failure or on a slow probe.
+//
+TEST_F(LbPoolTest, AdaptiveInterval) {
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval"] = 1;
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval_max"] = 4;
+  SetUp(true);
+
+  Healthcheck_dummy *hc =
+      (Healthcheck_dummy *)GetLbNode(test_lb_pool, "lbnode1")->healthchecks[0];
+
+  // Passed probes double the interval until the maximum is reached.
+  hc->dummy_end_check(HealthcheckResult::HC_PASS, "dummy_pass", 0);
+  EXPECT_NEAR(hc->dummy_next_due_ms(), 2000, 10);
+  hc->dummy_end_check(HealthcheckResult::HC_PASS, "dummy_pass", 0);
+  EXPECT_NEAR(hc->dummy_next_due_ms(), 4000, 10);
+  hc->dummy_end_check(HealthcheckResult::HC_PASS, "dummy_pass", 0);
+  EXPECT_NEAR(hc->dummy_next_due_ms(), 4000, 10);
+
+  // A probe much slower than usual returns to the base interval. Probes took
+  // no time until now.
+  hc->dummy_end_check(HealthcheckResult::HC_PASS, "dummy_pass",
+                      ADAPTIVE_LATENCY_SLACK + 50);
+  EXPECT_NEAR(hc->dummy_next_due_ms(), 1000, 10);
+  hc->dummy_end_check(HealthcheckResult::HC_PASS, "dummy_pass", 0);
+  EXPECT_NEAR(hc->dummy_next_due_ms(), 2000, 10);
+
+  // So does a failure, the interval stays there until the LB Node is hard
+  // up again.
+  for (int i = 0; i < 3; i++) {
+    EndDummyHC(test_lb_pool, "lbnode1", HealthcheckResult::HC_FAIL, false);
+    EXPECT_NEAR(hc->dummy_next_due_ms(), 1000, 10);
+  }
+  EXPECT_EQ(UpNodesNames(), set<string>({"lbnode2", "lbnode3"}));
+
+  hc->dummy_end_check(HealthcheckResult::HC_PASS, "dummy_pass", 0);
+  EXPECT_EQ(UpNodesNames(), set<string>({"lbnode1", "lbnode2", "lbnode3"}));
+  EXPECT_NEAR(hc->dummy_next_due_ms(), 2000, 10);
+}
+
+// New probes are started at the probe rate, tokens are not saved for longer
+// than one run of the scheduler.
+//
+TEST_F(LbPoolTest, ProbeRate) {
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval"] = 1;
+  SetUp(true);
+  Healthcheck::set_probe_budget(10, 0, 0, 0);
+
+  // All 6 checks are due, but 5s of quiet time are worth only one token.
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 5;
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 1);
+  EXPECT_EQ(stats.checks_deferred, 5);
+
+  // No more tokens without time passing.
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 1);
+  EXPECT_EQ(stats.checks_deferred, 5);
+  EXPECT_EQ(stats.deferrals, 10);
+
+  // 100ms are worth another token.
+  timespec_add_ms(&later, 100);
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 2);
+  EXPECT_EQ(stats.checks_deferred, 4);
+
+  // So are 10s.
+  later.tv_sec += 10;
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 3);
+  EXPECT_EQ(stats.checks_deferred, 3);
+}
+
+// Due checks wait while too many checks are running.
+//
+TEST_F(LbPoolTest, MaxRunningChecks) {
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval"] = 1;
+  SetUp(true);
+  Healthcheck::set_probe_budget(0, 4, 0, 0);
+
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 5;
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 4);
+  EXPECT_EQ(stats.checks_deferred, 2);
+
+  // Checks were due 1s to 2s after they have been created, so they are late
+  // by 3s to 4s.
+  EXPECT_GE(stats.deferral_ms, 3000);
+  EXPECT_LE(stats.deferral_ms, 4100);
+
+  // A finished check makes room for one more.
+  Healthcheck_dummy *finished = NULL;
+  for (LbNode *node : lb_pools[test_lb_pool]->nodes)
+    for (Healthcheck *hc : node->healthchecks)
+      if (!finished && ((Healthcheck_dummy *)hc)->dummy_is_running())
+        finished = (Healthcheck_dummy *)hc;
+  finished->dummy_end_check(HealthcheckResult::HC_PASS, "dummy_pass");
+  EXPECT_EQ(RunningChecks(test_lb_pool), 3);
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 4);
+  EXPECT_EQ(stats.checks_deferred, 1);
+}
+
+// Due checks wait while too many probe sockets are open.
+//
+TEST_F(LbPoolTest, MaxProbeSockets) {
+  SetUp(true);
+  Healthcheck::set_probe_budget(0, 0, 2, 0);
+
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 5;
+  stats.probe_sockets = 2;
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 0);
+  EXPECT_EQ(stats.checks_deferred, 6);
+
+  stats.probe_sockets = 0;
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 6);
+  EXPECT_EQ(stats.checks_deferred, 0);
+  EXPECT_EQ(stats.deferral_ms, 0);
+}
+
+// Started checks count against the limit of probe sockets before they open
+// them.
+//
+TEST_F(LbPoolTest, ReservedProbeSockets) {
+  base_config[test_lb_pool]["health_checks"][0]["hc_dummy_socket"] = true;
+  SetUp(true);
+  Healthcheck::set_probe_budget(0, 0, 2, 0);
+
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 5;
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 2);
+  EXPECT_EQ(stats.checks_deferred, 4);
+
+  // A finished check gives its socket back.
+  EndDummyHC(test_lb_pool, "lbnode1", HealthcheckResult::HC_PASS, true);
+  EndDummyHC(test_lb_pool, "lbnode2", HealthcheckResult::HC_PASS, true);
+  EndDummyHC(test_lb_pool, "lbnode3", HealthcheckResult::HC_PASS, true);
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 2);
+  EXPECT_EQ(stats.checks_deferred, 2);
+}
+
+// Checks of a busy destination wait, those of other destinations are
+// started even if they come later.
+//
+TEST_F(LbPoolTest, MaxDestinationChecks) {
+  string high_lb_pool = "lbpool2.example.com";
+  string low_lb_pool = "lbpool3.example.com";
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval"] = 1;
+  AddLbPool(high_lb_pool, "pool_1", "high", 1);
+  AddLbPool(low_lb_pool, "pool_2", "low", 1);
+  // Checks are ordered by priority: one of LB Node at 10.0.0.1, another one
+  // of a different LB Node at the same address and one at 10.0.0.3.
+  base_config[high_lb_pool]["nodes"] = {{"lbnode1", {{"ip4", "10.0.0.1"}}}};
+  base_config[high_lb_pool]["health_checks"][0]["hc_timeout"] = 2000;
+  base_config[test_lb_pool]["nodes"] = {{"lbnode2", {{"ip4", "10.0.0.1"}}}};
+  base_config[low_lb_pool]["nodes"] = {{"lbnode3", {{"ip4", "10.0.0.3"}}}};
+  SetUp(true);
+  Healthcheck::set_probe_budget(0, 0, 0, 1);
+
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 5;
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(high_lb_pool), 1);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 0);
+  EXPECT_EQ(RunningChecks(low_lb_pool), 1);
+  EXPECT_EQ(stats.checks_deferred, 1);
+  EXPECT_EQ(stats.destination_deferrals, 1);
+
+  // Once the destination is free the waiting check starts.
+  EndDummyHC(high_lb_pool, "lbnode1", HealthcheckResult::HC_PASS, true);
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 1);
+  EXPECT_EQ(stats.checks_deferred, 0);
+}
+
+// Checks which have been due for the longest time are started first.
+//
+TEST_F(LbPoolTest, OldestDueFirst) {
+  string other_lb_pool = "lbpool2.example.com";
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval"] = 1;
+  AddLbPool(other_lb_pool, "pool_1", "normal", 3);
+  SetUp(true);
+  Healthcheck::set_probe_budget(0, 6, 0, 0);
+
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 5;
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 6);
+  EXPECT_EQ(RunningChecks(other_lb_pool), 0);
+  EXPECT_EQ(stats.checks_deferred, 6);
+
+  // Checks of the other LB Pool were due 3s to 4s after they have been
+  // created.
+  EXPECT_GE(stats.deferral_ms, 1000);
+  EXPECT_LE(stats.deferral_ms, 2100);
+}
+
+// Checks with an interval which is not positive fall back to the default one,
+// hash phases too.
+//
+TEST_F(LbPoolTest, InvalidInterval) {
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval_ms"] = 0;
+  Healthcheck::set_hash_phases(true);
+  SetUp(true);
+  Healthcheck::set_hash_phases(false);
+
+  Healthcheck_dummy *hc =
+      (Healthcheck_dummy *)GetLbNode(test_lb_pool, "lbnode1")->healthchecks[0];
+  EXPECT_GT(hc->dummy_next_due_ms(), 0);
+  EXPECT_LE(hc->dummy_next_due_ms(), 2000);
+
+  EndDummyHC(test_lb_pool, "lbnode1", HealthcheckResult::HC_PASS, false);
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 2;
+  EXPECT_TRUE(hc->schedule_healthcheck(&later));
+}
+
+// The first runs of checks are spread over the warm-up period, with hash
+// phases too.
+//
+TEST_F(LbPoolTest, WarmUp) {
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval"] = 1;
+  Healthcheck::set_hash_phases(true);
+  SetUp(true);
+  Healthcheck::set_hash_phases(false);
+
+  Healthcheck::start_warm_up(5000);
+  for (LbNode *node : lb_pools[test_lb_pool]->nodes) {
+    for (Healthcheck *hc : node->healthchecks) {
+      EXPECT_GT(((Healthcheck_dummy *)hc)->dummy_next_due_ms(), 0);
+      EXPECT_LE(((Healthcheck_dummy *)hc)->dummy_next_due_ms(), 5010);
+    }
+  }
+}
+
+// The overload level follows the smoothed lag of the main loop. It falls only
+// once the lag is below half of what raised it.
+//
+TEST_F(LbPoolTest, OverloadLevel) {
+  SetUp(true);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  Healthcheck::measure_loop_lag(&now);
+  RunLate(&now, 0, 10);
+  EXPECT_EQ(stats.overload_level, 0);
+
+  RunLate(&now, 50, 50);
+  EXPECT_EQ(stats.loop_lag_ms, 49);
+  EXPECT_EQ(stats.overload_level, 1);
+
+  RunLate(&now, 20, 50);
+  EXPECT_EQ(stats.overload_level, 1);
+  RunLate(&now, 10, 50);
+  EXPECT_EQ(stats.overload_level, 0);
+
+  RunLate(&now, 500, 50);
+  EXPECT_EQ(stats.overload_level, 3);
+  RunLate(&now, 250, 50);
+  EXPECT_EQ(stats.overload_level, 3);
+  RunLate(&now, 150, 50);
+  EXPECT_EQ(stats.overload_level, 2);
+  RunLate(&now, 0, 100);
+  EXPECT_EQ(stats.overload_level, 0);
+}
+
+// Under overload intervals of checks are stretched by their priority.
+//
+TEST_F(LbPoolTest, OverloadStretch) {
+  base_config[test_lb_pool]["priority"] = "low";
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval"] = 1;
+  AddLbPool("lbpool2.example.com", "pool_1", "normal", 2);
+  AddLbPool("lbpool3.example.com", "pool_2", "high", 3);
+  SetUp(true);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  Healthcheck::measure_loop_lag(&now);
+
+  map<string, int> expected_intervals[] = {
+      {{test_lb_pool, 1000},
+       {"lbpool2.example.com", 2000},
+       {"lbpool3.example.com", 3000}},
+      {{test_lb_pool, 2000},
+       {"lbpool2.example.com", 2000},
+       {"lbpool3.example.com", 3000}},
+      {{test_lb_pool, 4000},
+       {"lbpool2.example.com", 4000},
+       {"lbpool3.example.com", 3000}},
+      {{test_lb_pool, 8000},
+       {"lbpool2.example.com", 8000},
+       {"lbpool3.example.com", 3000}},
+  };
+  int lags[] = {0, 50, 150, 500};
+
+  for (int level = 0; level <= OVERLOAD_LEVELS; level++) {
+    RunLate(&now, lags[level], 50);
+    EXPECT_EQ(stats.overload_level, level);
+
+    // Late enough for missed runs to be skipped, the next run is due one
+    // stretched interval later.
+    struct timespec later;
+    memcpy(&later, &now, sizeof(struct timespec));
+    later.tv_sec += 3600 * (level + 1);
+    for (auto &expected : expected_intervals[level]) {
+      Healthcheck_dummy *hc = (Healthcheck_dummy *)GetLbNode(expected.first,
+                                                             "lbnode1")
+                                  ->healthchecks[0];
+      EXPECT_TRUE(hc->schedule_healthcheck(&later));
+      EXPECT_EQ(hc->dummy_next_due_ms(), expected.second);
+      hc->dummy_end_check(HealthcheckResult::HC_PASS, "dummy_pass");
+    }
+  }
+}
+
+// Checks of high priority LB Pools are started first, even if checks of other
+// LB Pools have been due for longer.
+//
+TEST_F(LbPoolTest, HighPriorityFirst) {
+  string other_lb_pool = "lbpool2.example.com";
+  base_config[test_lb_pool]["health_checks"][0]["hc_interval"] = 1;
+  AddLbPool(other_lb_pool, "pool_1", "high", 3);
+  SetUp(true);
+  Healthcheck::set_probe_budget(0, 6, 0, 0);
+
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 5;
+  ScheduleChecks(&later);
+  EXPECT_EQ(RunningChecks(test_lb_pool), 0);
+  EXPECT_EQ(RunningChecks(other_lb_pool), 6);
+  EXPECT_EQ(stats.checks_deferred, 6);
+}
+
+// HTTPS probes run by a TLS worker hand their results over to the main loop.
+//
+TEST_F(LbPoolTest, HttpsWorker) {
+  evthread_use_pthreads();
+  eventBase = event_base_new();
+  sctx = SSL_CTX_new(TLS_client_method());
+  ASSERT_TRUE(Healthcheck_https::initialize(1));
+  // Nothing listens on the port, the connection is refused right away.
+  base_config[test_lb_pool]["health_checks"][0] = {
+      {"hc_type", "https"}, {"hc_port", 1}, {"hc_timeout", 5000}};
+  base_config[test_lb_pool]["nodes"]["lbnode1"]["ip4"] = "127.0.0.1";
+  SetUp(true);
+
+  Healthcheck *hc = GetLbNode(test_lb_pool, "lbnode1")->healthchecks[0];
+  struct timespec later;
+  clock_gettime(CLOCK_MONOTONIC, &later);
+  later.tv_sec += 3600;
+  EXPECT_TRUE(hc->schedule_healthcheck(&later));
+
+  // The worker is done with the probe, but the result waits for the main
+  // loop.
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  EXPECT_FALSE(hc->ran);
+
+  event_base_loop(eventBase, EVLOOP_ONCE);
+  EXPECT_TRUE(hc->ran);
+  EXPECT_EQ(hc->last_state, HealthcheckState::STATE_DOWN);
+
+  Healthcheck_https::destroy();
+  SSL_CTX_free(sctx);
+  sctx = NULL;
+  event_base_free(eventBase);
+  eventBase = NULL;
+}
@@ -11,6 +11,7 @@
 #include "healthcheck_dummy.h"
 #include "lb_node.h"
 #include "msg.h"
+#include "stats.h"
 #include "testtool_test.h"
 
 using namespace std;
@@ -52,6 +53,7 @@ void log(MessageType loglevel, Healthcheck *hc, string msg) {
 };
 
 set<string> sent_up_lb_nodes;
+int sent_messages = 0;
 bool send_message(message_queue *mq, string pool_name, string table_name,
                   set<LbNode *> all_lb_nodes, set<LbNode *> up_lb_nodes) {
   // Make compiler happy
@@ -62,6 +64,7 @@ bool send_message(message_queue *mq, string pool_name, string table_name,
 
   for (LbNode *up_lb_node : up_lb_nodes)
     sent_up_lb_nodes.insert(up_lb_node->name);
+  sent_messages++;
 
   return true;
 }
@@ -84,6 +87,17 @@ void TesttoolTest::SetUp(bool init_state) {
 }
 
 void TesttoolTest::TearDown() {
+  Healthcheck::forget_probes();
+  Healthcheck::forget_probe_budget();
+  Healthcheck::forget_loop_lag();
+  stats.probe_sockets = 0;
+  stats.checks_running = 0;
+  stats.checks_deferred = 0;
+  stats.deferrals = 0;
+  stats.destination_deferrals = 0;
+  stats.deferral_ms = 0;
+  stats.loop_lag_ms = 0;
+  stats.overload_level = 0;
   lb_pools.clear();
   up_nodes_test.clear();
 }